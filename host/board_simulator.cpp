@@ -0,0 +1,219 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Trapti Damodar Balgi
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Trapti Damodar Balgi and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+* @file board_simulator.cpp
+* @brief
+*
+* Presents a pseudo-terminal that sends the same telemetry frames as the board,
+* so telemetry_collector can be run and load-tested without hardware
+*
+* Usage: board_simulator [-r frames per second] [-t text frame every n frames] [-c corrupt frame every n frames] [-n frames]
+*
+* @author Trapti Damodar Balgi
+* @date 13th December 2023
+* @version 1.0
+*/
+
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+#include "telemetry_protocol.hpp"
+
+namespace {
+
+constexpr long NS_PER_S = 1000000000L;
+constexpr std::size_t MAX_BATCH = 4096;		// Frames written with one write() at high rates
+
+volatile std::sig_atomic_t running = 1;
+
+void stop(int)
+{
+	running = 0;
+}
+
+struct Options {
+	double rate = 10.0;
+	unsigned long text_every = 0;
+	unsigned long corrupt_every = 0;
+	unsigned long count = 0;			// 0 runs until interrupted
+};
+
+bool parse_options(int argc, char *argv[], Options &options)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "r:t:c:n:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'r': options.rate = std::strtod(optarg, nullptr); break;
+		case 't': options.text_every = std::strtoul(optarg, nullptr, 10); break;
+		case 'c': options.corrupt_every = std::strtoul(optarg, nullptr, 10); break;
+		case 'n': options.count = std::strtoul(optarg, nullptr, 10); break;
+		default: return false;
+		}
+	}
+	return options.rate > 0.0;
+}
+
+void add_ns(timespec &time, long ns)
+{
+	time.tv_nsec += ns;
+	while (time.tv_nsec >= NS_PER_S)
+	{
+		time.tv_nsec -= NS_PER_S;
+		time.tv_sec++;
+	}
+}
+
+bool write_all(int fd, const std::uint8_t *data, std::size_t length)
+{
+	while (length > 0)
+	{
+		ssize_t written = write(fd, data, length);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += written;
+		length -= static_cast<std::size_t>(written);
+	}
+	return true;
+}
+
+// Slowly drifting readings, as a DHT11 in a room would give
+telemetry::Frame make_sample(std::uint16_t sequence, std::uint32_t rtc_seconds, unsigned long index)
+{
+	double phase = static_cast<double>(index) / 500.0;
+	double humidity = 45.0 + 10.0 * std::sin(phase);
+	double temperature = 22.0 + 3.0 * std::cos(phase);
+
+	telemetry::Frame frame;
+	frame.type = telemetry::FRAME_SAMPLE;
+	frame.sequence = sequence;
+	frame.rtc_seconds = rtc_seconds;
+	frame.payload = {
+		static_cast<std::uint8_t>(humidity), static_cast<std::uint8_t>(std::fmod(humidity, 1.0) * 10.0),
+		static_cast<std::uint8_t>(temperature), static_cast<std::uint8_t>(std::fmod(temperature, 1.0) * 10.0)
+	};
+	return frame;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+	Options options;
+	if (!parse_options(argc, argv, options))
+	{
+		std::fprintf(stderr, "Usage: %s [-r frames per second] [-t text frame every n frames] [-c corrupt frame every n frames] [-n frames]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+	if ((master < 0) || (grantpt(master) != 0) || (unlockpt(master) != 0))
+	{
+		std::perror("posix_openpt");
+		return EXIT_FAILURE;
+	}
+	const char *slave_name = ptsname(master);
+
+	// Hold the slave open in raw mode so the line discipline passes bytes through untouched,
+	// and writes do not fail while no collector is attached
+	int slave = open(slave_name, O_RDWR | O_NOCTTY);
+	termios settings;
+	if ((slave < 0) || (tcgetattr(slave, &settings) != 0))
+	{
+		std::perror(slave_name);
+		return EXIT_FAILURE;
+	}
+	cfmakeraw(&settings);
+	tcsetattr(slave, TCSANOW, &settings);
+
+	std::signal(SIGINT, stop);
+	std::signal(SIGTERM, stop);
+	std::printf("%s\n", slave_name);
+	std::fflush(stdout);
+
+	// Frames due per wakeup, so rates in the thousands do not need a wakeup per frame
+	long period_ns = static_cast<long>(NS_PER_S / options.rate);
+	std::size_t batch = 1;
+	while ((period_ns * static_cast<long>(batch) < 1000000L) && (batch < MAX_BATCH))
+		batch *= 2;
+
+	timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	timespec start = next;
+
+	std::uint16_t sequence = 0;
+	unsigned long sent = 0;
+	std::vector<std::uint8_t> out;
+
+	while (running && ((options.count == 0) || (sent < options.count)))
+	{
+		out.clear();
+		for (std::size_t i = 0; (i < batch) && ((options.count == 0) || (sent < options.count)); i++, sent++)
+		{
+			std::uint32_t rtc_seconds = static_cast<std::uint32_t>(next.tv_sec - start.tv_sec);
+			telemetry::Frame frame = make_sample(sequence, rtc_seconds, sent);
+			if ((options.text_every != 0) && (sent % options.text_every == options.text_every - 1))
+			{
+				static const char text[] = "\n\r$$ ";
+				frame.type = telemetry::FRAME_TEXT;
+				frame.payload.assign(text, text + sizeof(text) - 1);
+			}
+
+			std::vector<std::uint8_t> encoded = telemetry::encode_frame(frame);
+			// Flip a payload bit to exercise the CRC check on the collector
+			if ((options.corrupt_every != 0) && (sent % options.corrupt_every == options.corrupt_every - 1))
+				encoded[encoded.size() / 2] ^= (encoded[encoded.size() / 2] == 0x01) ? 0x02 : 0x01;
+			out.insert(out.end(), encoded.begin(), encoded.end());
+			sequence++;
+		}
+
+		if (!write_all(master, out.data(), out.size()))
+		{
+			std::perror("write");
+			break;
+		}
+
+		add_ns(next, period_ns * static_cast<long>(batch));
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, nullptr) == EINTR)
+		{
+			if (!running)
+				break;
+		}
+	}
+
+	std::fprintf(stderr, "%lu frames sent\n", sent);
+	// Closing the master hangs up the slave, so let the collector read what is still queued first
+	for (int wait = 0; wait < 200; wait++)
+	{
+		int queued = 0;
+		if ((ioctl(slave, FIONREAD, &queued) != 0) || (queued == 0))
+			break;
+		usleep(10000);
+	}
+	close(slave);
+	close(master);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,268 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Trapti Damodar Balgi
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Trapti Damodar Balgi and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+* @file telemetry_collector.cpp
+* @brief
+*
+* Reads the telemetry stream of the board from a serial device, checks and decodes every frame,
+* appends the samples to a CSV time series and prints summary statistics once a second
+*
+* Usage: telemetry_collector [-b baud] [-o samples.csv] <serial device>
+*
+* @author Trapti Damodar Balgi
+* @date 13th December 2023
+* @version 1.0
+*/
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#include "telemetry_protocol.hpp"
+
+namespace {
+
+constexpr std::size_t READ_SIZE = 65536;
+constexpr int REPORT_PERIOD_MS = 1000;
+
+volatile std::sig_atomic_t running = 1;
+
+void stop(int)
+{
+	running = 0;
+}
+
+struct Options {
+	unsigned long baud = 38400;
+	std::string output = "samples.csv";
+	const char *device = nullptr;
+};
+
+struct Stats {
+	unsigned long long bytes = 0;
+	unsigned long long samples = 0;
+	unsigned long long texts = 0;
+	unsigned long long unknown = 0;
+	unsigned long long bad_cobs = 0;
+	unsigned long long bad_length = 0;
+	unsigned long long bad_crc = 0;
+	unsigned long long lost = 0;			// Frames missing from the sequence numbers
+	bool have_sequence = false;
+	std::uint16_t last_sequence = 0;
+	std::uint8_t last_reading[4] = {0, 0, 0, 0};
+	std::uint32_t last_rtc_seconds = 0;
+};
+
+bool parse_options(int argc, char *argv[], Options &options)
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "b:o:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'b': options.baud = std::strtoul(optarg, nullptr, 10); break;
+		case 'o': options.output = optarg; break;
+		default: return false;
+		}
+	}
+	if (optind != argc - 1)
+		return false;
+	options.device = argv[optind];
+	return true;
+}
+
+speed_t to_speed(unsigned long baud)
+{
+	switch (baud)
+	{
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+	case 460800: return B460800;
+	default: return B0;
+	}
+}
+
+// Raw 8N1, or the board's boot default of 8O2 at 38400
+bool configure(int fd, unsigned long baud)
+{
+	termios settings;
+	if (tcgetattr(fd, &settings) != 0)
+		return false;
+	cfmakeraw(&settings);
+	settings.c_cflag |= CLOCAL | CREAD;
+	if (baud == 38400)
+		settings.c_cflag |= PARENB | PARODD | CSTOPB;
+
+	speed_t speed = to_speed(baud);
+	if (speed == B0)
+	{
+		std::fprintf(stderr, "Unsupported baud rate %lu\n", baud);
+		return false;
+	}
+	cfsetispeed(&settings, speed);
+	cfsetospeed(&settings, speed);
+	return tcsetattr(fd, TCSANOW, &settings) == 0;
+}
+
+void handle_frame(const telemetry::Frame &frame, Stats &stats, std::FILE *csv, std::chrono::system_clock::time_point now)
+{
+	if (stats.have_sequence)
+		stats.lost += static_cast<std::uint16_t>(frame.sequence - stats.last_sequence - 1);
+	stats.have_sequence = true;
+	stats.last_sequence = frame.sequence;
+	stats.last_rtc_seconds = frame.rtc_seconds;
+
+	if ((frame.type == telemetry::FRAME_SAMPLE) && (frame.payload.size() == 4))
+	{
+		stats.samples++;
+		std::memcpy(stats.last_reading, frame.payload.data(), 4);
+		long long host_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+		std::fprintf(csv, "%lld,%u,%lu,%u.%u,%u.%u\n", host_ns, frame.sequence, static_cast<unsigned long>(frame.rtc_seconds),
+				frame.payload[0], frame.payload[1], frame.payload[2], frame.payload[3]);
+	}
+	else if (frame.type == telemetry::FRAME_TEXT)
+	{
+		stats.texts++;
+		std::fwrite(frame.payload.data(), 1, frame.payload.size(), stdout);
+	}
+	else
+	{
+		stats.unknown++;
+	}
+}
+
+void report(const Stats &stats, const Stats &previous, double seconds)
+{
+	unsigned long long frames = stats.samples + stats.texts + stats.unknown;
+	unsigned long long previous_frames = previous.samples + previous.texts + previous.unknown;
+
+	std::fprintf(stderr, "%8.0f frames/s %9.0f B/s | samples %llu text %llu | lost %llu crc %llu cobs %llu length %llu | RTC %lus H %u.%u%% T %u.%uC\n",
+			static_cast<double>(frames - previous_frames) / seconds, static_cast<double>(stats.bytes - previous.bytes) / seconds,
+			stats.samples, stats.texts, stats.lost, stats.bad_crc, stats.bad_cobs, stats.bad_length,
+			static_cast<unsigned long>(stats.last_rtc_seconds),
+			stats.last_reading[0], stats.last_reading[1], stats.last_reading[2], stats.last_reading[3]);
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+	Options options;
+	if (!parse_options(argc, argv, options))
+	{
+		std::fprintf(stderr, "Usage: %s [-b baud] [-o samples.csv] <serial device>\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int fd = open(options.device, O_RDONLY | O_NOCTTY);
+	if (fd < 0)
+	{
+		std::perror(options.device);
+		return EXIT_FAILURE;
+	}
+	if (!configure(fd, options.baud))
+	{
+		std::fprintf(stderr, "%s: cannot set line settings\n", options.device);
+		return EXIT_FAILURE;
+	}
+
+	std::FILE *csv = std::fopen(options.output.c_str(), "a");
+	if (csv == nullptr)
+	{
+		std::perror(options.output.c_str());
+		return EXIT_FAILURE;
+	}
+	if (std::ftell(csv) == 0)
+		std::fprintf(csv, "host_time_ns,sequence,rtc_seconds,humidity,temperature\n");
+
+	std::signal(SIGINT, stop);
+	std::signal(SIGTERM, stop);
+
+	std::vector<std::uint8_t> buffer(READ_SIZE);
+	std::vector<std::uint8_t> scratch;
+	scratch.reserve(telemetry::MAX_FRAME);
+	telemetry::FrameSplitter splitter;
+	telemetry::Frame frame;
+	Stats stats, previous;
+
+	auto started = std::chrono::steady_clock::now();
+	auto last_report = started;
+
+	while (running)
+	{
+		pollfd pfd = {fd, POLLIN, 0};
+		int ready = poll(&pfd, 1, REPORT_PERIOD_MS);
+		if ((ready < 0) && (errno != EINTR))
+		{
+			std::perror("poll");
+			break;
+		}
+
+		if ((ready > 0) && (pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+		{
+			ssize_t length = read(fd, buffer.data(), buffer.size());
+			// A pty reports EIO once the simulator has gone away
+			if ((length == 0) || ((length < 0) && (errno != EINTR) && (errno != EAGAIN)))
+				break;
+			if (length > 0)
+			{
+				stats.bytes += static_cast<unsigned long long>(length);
+				auto now = std::chrono::system_clock::now();
+				splitter.feed(buffer.data(), static_cast<std::size_t>(length),
+						[&](const std::uint8_t *block, std::size_t block_length, bool overflowed) {
+					if (overflowed)
+					{
+						stats.bad_length++;
+						return;
+					}
+					switch (telemetry::decode_frame(block, block_length, frame, scratch))
+					{
+					case telemetry::DecodeStatus::OK: handle_frame(frame, stats, csv, now); break;
+					case telemetry::DecodeStatus::BAD_COBS: stats.bad_cobs++; break;
+					case telemetry::DecodeStatus::BAD_CRC: stats.bad_crc++; break;
+					default: stats.bad_length++; break;
+					}
+				});
+			}
+		}
+
+		auto now = std::chrono::steady_clock::now();
+		if (now - last_report >= std::chrono::milliseconds(REPORT_PERIOD_MS))
+		{
+			report(stats, previous, std::chrono::duration<double>(now - last_report).count());
+			std::fflush(stdout);
+			std::fflush(csv);
+			previous = stats;
+			last_report = now;
+		}
+	}
+
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	Stats nothing;
+	std::fprintf(stderr, "Total over %.1f s:\n", elapsed);
+	report(stats, nothing, elapsed);
+
+	std::fclose(csv);
+	close(fd);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,213 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Trapti Damodar Balgi
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Trapti Damodar Balgi and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+* @file telemetry_protocol.hpp
+* @brief
+*
+* Host side of the binary telemetry frames sent by source/telemetry.c
+*
+* A frame is COBS encoded and ends with a 0x00 delimiter. Decoded, it holds
+*   type (1 byte), sequence number (2 bytes), RTC seconds (4 bytes), payload, CRC16 (2 bytes)
+* Multi-byte fields are little endian. The CRC16 is CCITT (polynomial 0x1021, initial 0xFFFF).
+*
+* @author Trapti Damodar Balgi
+* @date 13th December 2023
+* @version 1.0
+*/
+
+#ifndef TELEMETRY_PROTOCOL_HPP_
+#define TELEMETRY_PROTOCOL_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace telemetry {
+
+constexpr std::size_t HEADER_LENGTH = 7;
+constexpr std::size_t CRC_LENGTH = 2;
+constexpr std::size_t MAX_PAYLOAD = 64;
+constexpr std::size_t MAX_FRAME = HEADER_LENGTH + MAX_PAYLOAD + CRC_LENGTH;
+
+enum FrameType : std::uint8_t {
+	FRAME_SAMPLE = 1,		// humidity integer, humidity decimal, temperature integer, temperature decimal
+	FRAME_TEXT = 2			// text written by the board while in binary mode
+};
+
+// Why a frame could not be used
+enum class DecodeStatus {
+	OK,
+	BAD_COBS,
+	TOO_SHORT,
+	TOO_LONG,
+	BAD_CRC
+};
+
+struct Frame {
+	std::uint8_t type = 0;
+	std::uint16_t sequence = 0;
+	std::uint32_t rtc_seconds = 0;
+	std::vector<std::uint8_t> payload;
+};
+
+/*
+ * Computes the CRC16-CCITT of a buffer, bit by bit so it does not share a table with the board
+ */
+inline std::uint16_t crc16(const std::uint8_t *data, std::size_t length)
+{
+	std::uint16_t crc = 0xFFFF;
+	for (std::size_t i = 0; i < length; i++)
+	{
+		crc ^= static_cast<std::uint16_t>(data[i] << 8);
+		for (int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? static_cast<std::uint16_t>((crc << 1) ^ 0x1021) : static_cast<std::uint16_t>(crc << 1);
+	}
+	return crc;
+}
+
+/*
+ * COBS encodes a buffer and appends the 0x00 delimiter
+ */
+inline void cobs_encode(const std::uint8_t *in, std::size_t length, std::vector<std::uint8_t> &out)
+{
+	std::size_t code_index = out.size();
+	std::uint8_t code = 1;
+
+	out.push_back(0);
+	for (std::size_t i = 0; i < length; i++)
+	{
+		if (in[i] == 0)
+		{
+			out[code_index] = code;
+			code_index = out.size();
+			out.push_back(0);
+			code = 1;
+		}
+		else
+		{
+			out.push_back(in[i]);
+			if (++code == 0xFF)
+			{
+				out[code_index] = code;
+				code_index = out.size();
+				out.push_back(0);
+				code = 1;
+			}
+		}
+	}
+	out[code_index] = code;
+	out.push_back(0);
+}
+
+/*
+ * Decodes one COBS block, without its delimiter. Returns false if the block is malformed.
+ */
+inline bool cobs_decode(const std::uint8_t *in, std::size_t length, std::vector<std::uint8_t> &out)
+{
+	out.clear();
+	std::size_t i = 0;
+	while (i < length)
+	{
+		std::uint8_t code = in[i++];
+		if ((code == 0) || (i + code - 1 > length))
+			return false;
+		for (std::uint8_t k = 1; k < code; k++)
+			out.push_back(in[i++]);
+		// Every block but a full one and the last implies a zero
+		if ((code != 0xFF) && (i < length))
+			out.push_back(0);
+	}
+	return true;
+}
+
+/*
+ * Builds the encoded bytes of a frame, delimiter included
+ */
+inline std::vector<std::uint8_t> encode_frame(const Frame &frame)
+{
+	std::vector<std::uint8_t> raw;
+	raw.reserve(HEADER_LENGTH + frame.payload.size() + CRC_LENGTH);
+	raw.push_back(frame.type);
+	raw.push_back(static_cast<std::uint8_t>(frame.sequence));
+	raw.push_back(static_cast<std::uint8_t>(frame.sequence >> 8));
+	for (int shift = 0; shift < 32; shift += 8)
+		raw.push_back(static_cast<std::uint8_t>(frame.rtc_seconds >> shift));
+	raw.insert(raw.end(), frame.payload.begin(), frame.payload.end());
+	std::uint16_t crc = crc16(raw.data(), raw.size());
+	raw.push_back(static_cast<std::uint8_t>(crc));
+	raw.push_back(static_cast<std::uint8_t>(crc >> 8));
+
+	std::vector<std::uint8_t> encoded;
+	encoded.reserve(raw.size() + raw.size() / 254 + 2);
+	cobs_encode(raw.data(), raw.size(), encoded);
+	return encoded;
+}
+
+/*
+ * Decodes one frame from the bytes between two delimiters
+ */
+inline DecodeStatus decode_frame(const std::uint8_t *in, std::size_t length, Frame &frame, std::vector<std::uint8_t> &scratch)
+{
+	if (!cobs_decode(in, length, scratch))
+		return DecodeStatus::BAD_COBS;
+	if (scratch.size() < HEADER_LENGTH + CRC_LENGTH)
+		return DecodeStatus::TOO_SHORT;
+	if (scratch.size() > MAX_FRAME)
+		return DecodeStatus::TOO_LONG;
+
+	std::size_t body = scratch.size() - CRC_LENGTH;
+	std::uint16_t crc = static_cast<std::uint16_t>(scratch[body] | (scratch[body + 1] << 8));
+	if (crc != crc16(scratch.data(), body))
+		return DecodeStatus::BAD_CRC;
+
+	frame.type = scratch[0];
+	frame.sequence = static_cast<std::uint16_t>(scratch[1] | (scratch[2] << 8));
+	frame.rtc_seconds = static_cast<std::uint32_t>(scratch[3]) | (static_cast<std::uint32_t>(scratch[4]) << 8) |
+			(static_cast<std::uint32_t>(scratch[5]) << 16) | (static_cast<std::uint32_t>(scratch[6]) << 24);
+	frame.payload.assign(scratch.begin() + HEADER_LENGTH, scratch.begin() + body);
+	return DecodeStatus::OK;
+}
+
+/*
+ * Splits a byte stream into frames at the 0x00 delimiters, across reads of any size.
+ * on_block(data, length, overflowed) gets each block; overflowed blocks were cut short and cannot be decoded.
+ */
+class FrameSplitter {
+public:
+	template <typename Callback>
+	void feed(const std::uint8_t *data, std::size_t length, Callback on_block)
+	{
+		for (std::size_t i = 0; i < length; i++)
+		{
+			if (data[i] != 0)
+			{
+				// A block longer than any valid frame is noise; keep dropping until the next delimiter
+				if (pending_.size() <= MAX_FRAME + MAX_FRAME / 254 + 1)
+					pending_.push_back(data[i]);
+				else
+					overflowed_ = true;
+				continue;
+			}
+			if (!pending_.empty() || overflowed_)
+				on_block(pending_.data(), pending_.size(), overflowed_);
+			pending_.clear();
+			overflowed_ = false;
+		}
+	}
+
+private:
+	std::vector<std::uint8_t> pending_;
+	bool overflowed_ = false;
+};
+
+} // namespace telemetry
+
+#endif /* TELEMETRY_PROTOCOL_HPP_ */
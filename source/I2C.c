@@ -24,9 +24,68 @@
 
 #include <I2C.h>
 #include <MKL25Z4.H>
+#include <stddef.h>
+#include "fsl_clock.h"
+#include "timers.h"
+#include "I2C_trace.h"
 
-int lock_detect=0;
-int i2c_lock=0;
+#define I2C_READ_BIT (0x01)
+#define I2C_IRQ_PRIORITY (1)
+
+#define I2C_DMA_CHANNEL (0)
+#define I2C_DMA_SOURCE (22)			// DMAMUX request source for I2C0
+#define I2C_DMA_IRQ_PRIORITY (1)
+#define DMA_8_BIT (1)
+
+#define I2C_SCL_PIN (0)				// PTB0
+#define I2C_SDA_PIN (1)				// PTB1
+#define I2C_RECOVERY_CLOCKS (9)
+#define I2C_RECOVERY_HALF_PERIOD_US (5)
+
+#define I2C_DIVIDER_SETTINGS (64)
+#define I2C_MULT_SETTINGS (3)
+
+// States of the interrupt driven engine
+typedef enum {
+	ENGINE_IDLE,
+	ENGINE_WRITE,
+	ENGINE_WRITE_DMA,
+	ENGINE_READ_ADDRESS,
+	ENGINE_READ
+} engine_state_t;
+
+static i2c_stats_t i2c_stats;
+static bool bus_error = false;		// Set by a failed wait, skips the rest of a polled transaction
+static i2c_status_t polled_status = I2C_DONE;
+static uint32_t byte_timeout_us = I2C_TIMEOUT_US;
+static uint32_t bus_speed_hz = 0;
+static uint32_t max_reliable_speed_hz = I2C_FAST_SPEED_HZ;
+
+// Speeds tried by the bus self-test, slowest first
+static const uint32_t test_speed_hz[I2C_SPEED_TEST_STEPS] = {
+	100000, 200000, 300000, 400000, 600000, 800000, 1000000, 1200000
+};
+
+// SCL divider for each ICR value (KL25 reference manual, I2C divider table)
+static const uint16_t scl_divider[I2C_DIVIDER_SETTINGS] = {
+	20, 22, 24, 26, 28, 30, 34, 40, 28, 32, 36, 40, 44, 48, 56, 68,
+	48, 56, 64, 72, 80, 88, 104, 128, 80, 96, 112, 128, 144, 160, 192, 240,
+	160, 192, 224, 256, 288, 320, 384, 480, 320, 384, 448, 512, 576, 640, 768, 960,
+	640, 768, 896, 1024, 1152, 1280, 1536, 1920, 1280, 1536, 1792, 2048, 2304, 2560, 3072, 3840
+};
+
+// Queue of pending transactions and the one on the bus
+static i2c_transaction_t *queue[I2C_QUEUE_LENGTH];
+static uint8_t queue_head = 0, queue_tail = 0;
+static volatile uint8_t queue_count = 0;
+static i2c_transaction_t * volatile current = NULL;
+static volatile engine_state_t engine_state = ENGINE_IDLE;
+static volatile uint16_t byte_index = 0;
+static volatile uint8_t polled_depth = 0;
+static volatile uint32_t cpu_cycles = 0;
+static uint32_t transaction_start = 0, transaction_timeout = 0;
+
+static void start_next(void);
 
 /*
  * This function initializes the I2C bus
@@ -43,81 +102,162 @@ void init_I2C(void)
 	SIM->SCGC5 |= (SIM_SCGC5_PORTB_MASK);
 
 	// Set pins to I2C function
-	PORTB->PCR[0] |= PORT_PCR_MUX(2);
-	PORTB->PCR[1] |= PORT_PCR_MUX(2);
+	PORTB->PCR[I2C_SCL_PIN] |= PORT_PCR_MUX(2);
+	PORTB->PCR[I2C_SDA_PIN] |= PORT_PCR_MUX(2);
 
-	I2C0->F = (I2C_F_ICR(0x10) | I2C_F_MULT(0));
+	set_speed_I2C(I2C_DEFAULT_SPEED_HZ);
 
 	// Enable I2C and set to master mode
 	I2C0->C1 |= (I2C_C1_IICEN_MASK);
 
 	// Select high drive mode
 	I2C0->C2 |= (I2C_C2_HDRS_MASK);
+
+	// The interrupt itself is only enabled in C1 while the engine owns the bus
+	NVIC_SetPriority(I2C0_IRQn, I2C_IRQ_PRIORITY);
+	NVIC_ClearPendingIRQ(I2C0_IRQn);
+	NVIC_EnableIRQ(I2C0_IRQn);
+
+	// DMA channel fed by the I2C0 transfer complete request for long writes
+	SIM->SCGC6 |= SIM_SCGC6_DMAMUX_MASK;
+	SIM->SCGC7 |= SIM_SCGC7_DMA_MASK;
+	DMAMUX0->CHCFG[I2C_DMA_CHANNEL] = 0;
+	DMA0->DMA[I2C_DMA_CHANNEL].DAR = (uint32_t)&I2C0->D;
+	DMAMUX0->CHCFG[I2C_DMA_CHANNEL] = DMAMUX_CHCFG_ENBL_MASK | DMAMUX_CHCFG_SOURCE(I2C_DMA_SOURCE);
+	NVIC_SetPriority(DMA0_IRQn, I2C_DMA_IRQ_PRIORITY);
+	NVIC_ClearPendingIRQ(DMA0_IRQn);
+	NVIC_EnableIRQ(DMA0_IRQn);
 }
 
 /*
- * This function is for I2C busy check
+ * This function waits for a number of microseconds
+ *
+ * Parameters: microseconds
+ *
+ * Returns: none
+ *
+ */
+static void delay_us_I2C(uint32_t us)
+{
+	uint32_t start = cycle_count();
+	while ((cycle_count() - start) < US_TO_CYCLES(us));
+}
+
+/*
+ * This function frees a bus held by a slave. SCL is clocked as a GPIO until the slave
+ * releases SDA, then a STOP condition is generated and I2C0 is re-enabled
  *
  * Parameters: none
  *
  * Returns: none
  *
  */
-void busy_I2C(void)
+static void recover_I2C(void)
 {
-	// Start Signal
-	lock_detect = 0;
-	I2C0->C1 &= ~I2C_C1_IICEN_MASK;
-	I2C_TRAN;
-	I2C_M_START;
-	I2C0->C1 |=  I2C_C1_IICEN_MASK;
+	I2C0->C1 &= ~(I2C_C1_IICEN_MASK | I2C_C1_IICIE_MASK | I2C_C1_DMAEN_MASK | I2C_C1_MST_MASK);
+	DMA0->DMA[I2C_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_DONE_MASK;
 
-	// Write to clear line
-	I2C0->C1 |= I2C_C1_MST_MASK; 	// Set MASTER mode
-	I2C0->C1 |= I2C_C1_TX_MASK; 	// Set transmit (TX) mode
-	I2C0->D = 0xFF;
-	while ((I2C0->S & I2C_S_IICIF_MASK) == 0U) {
-	} // Wait interrupt
-	I2C0->S |= I2C_S_IICIF_MASK; // Clear interrupt bit
+	// Both lines as open drain GPIOs: released = input, driven = output low
+	PORTB->PCR[I2C_SCL_PIN] = PORT_PCR_MUX(1);
+	PORTB->PCR[I2C_SDA_PIN] = PORT_PCR_MUX(1);
+	GPIOB->PCOR = (1 << I2C_SCL_PIN) | (1 << I2C_SDA_PIN);
+	GPIOB->PDDR &= ~((1 << I2C_SCL_PIN) | (1 << I2C_SDA_PIN));
 
-	I2C0->S |= I2C_S_ARBL_MASK;	// Clear arbitration error flag
+	// Clock out whatever byte the slave is still sending
+	for (int i = 0; (i < I2C_RECOVERY_CLOCKS) && !(GPIOB->PDIR & (1 << I2C_SDA_PIN)); i++)
+	{
+		GPIOB->PDDR |= (1 << I2C_SCL_PIN);
+		delay_us_I2C(I2C_RECOVERY_HALF_PERIOD_US);
+		GPIOB->PDDR &= ~(1 << I2C_SCL_PIN);
+		delay_us_I2C(I2C_RECOVERY_HALF_PERIOD_US);
+	}
 
-	// Send start
-	I2C0->C1 &= ~I2C_C1_IICEN_MASK;
-	I2C0->C1 |= I2C_C1_TX_MASK; // Set transmit (TX) mode
-	I2C0->C1 |= I2C_C1_MST_MASK; // START signal generated
-	I2C0->C1 |= I2C_C1_IICEN_MASK; // Wait until start is sent
+	// STOP: SDA rises while SCL is high
+	GPIOB->PDDR |= (1 << I2C_SCL_PIN);
+	delay_us_I2C(I2C_RECOVERY_HALF_PERIOD_US);
+	GPIOB->PDDR |= (1 << I2C_SDA_PIN);
+	delay_us_I2C(I2C_RECOVERY_HALF_PERIOD_US);
+	GPIOB->PDDR &= ~(1 << I2C_SCL_PIN);
+	delay_us_I2C(I2C_RECOVERY_HALF_PERIOD_US);
+	GPIOB->PDDR &= ~(1 << I2C_SDA_PIN);
+	delay_us_I2C(I2C_RECOVERY_HALF_PERIOD_US);
 
-	// Send stop
-	I2C0->C1 &= ~I2C_C1_IICEN_MASK;
-	I2C0->C1 |= I2C_C1_MST_MASK;
-	I2C0->C1 &= ~I2C_C1_MST_MASK; // Set SLAVE mode
-	I2C0->C1 &= ~I2C_C1_TX_MASK; // Set Rx
-	I2C0->C1 |= I2C_C1_IICEN_MASK; // Wait
-	I2C0->S |= I2C_S_IICIF_MASK; // Clear arbitration error & interrupt flag
-	I2C0->S |= I2C_S_ARBL_MASK;
-	lock_detect = 0;
-	i2c_lock = 1;
+	PORTB->PCR[I2C_SCL_PIN] = PORT_PCR_MUX(2);
+	PORTB->PCR[I2C_SDA_PIN] = PORT_PCR_MUX(2);
+	I2C0->C1 = I2C_C1_IICEN_MASK;
+	I2C0->S = I2C_S_IICIF_MASK | I2C_S_ARBL_MASK;
+	i2c_stats.recoveries++;
 }
 
 /*
- * This function waits for transmission to complete
+ * This function waits for the bus to be free after a stop
  *
  * Parameters: none
  *
- * Returns: none
+ * Returns: true if free, false if it had to be recovered
  *
  */
-void wait_I2C(void)
+static bool wait_bus_free(void)
 {
-	lock_detect = 0;
-	while(((I2C0->S & I2C_S_IICIF_MASK)==0) & (lock_detect < 200))
+	uint32_t start = cycle_count();
+	while (I2C0->S & I2C_S_BUSY_MASK)
 	{
-		lock_detect++;
-	} 
-	if (lock_detect >= 200)
-		busy_I2C();
-	I2C0->S |= I2C_S_IICIF_MASK;
+		if ((cycle_count() - start) > US_TO_CYCLES(byte_timeout_us))
+		{
+			i2c_stats.timeouts++;
+			recover_I2C();
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * This function waits for transmission to complete. After a timeout the bus is
+ * recovered, after a NACK a stop is sent, and the rest of the polled transaction is skipped
+ *
+ * Parameters: none
+ *
+ * Returns: true on success, false on timeout, NACK or arbitration loss
+ *
+ */
+bool wait_I2C(void)
+{
+	if (bus_error)
+		return false;
+
+	uint32_t start = cycle_count();
+	while ((I2C0->S & I2C_S_IICIF_MASK) == 0)
+	{
+		if ((cycle_count() - start) > US_TO_CYCLES(byte_timeout_us))
+		{
+			i2c_stats.timeouts++;
+			recover_I2C();
+			polled_status = I2C_TIMEOUT;
+			bus_error = true;
+			return false;
+		}
+	}
+	I2C0->S = I2C_S_IICIF_MASK;
+
+	if (I2C0->S & I2C_S_ARBL_MASK)
+	{
+		I2C0->S = I2C_S_ARBL_MASK;
+		i2c_stats.arbitration_lost++;
+		polled_status = I2C_ARBITRATION_LOST;
+		bus_error = true;
+		return false;
+	}
+	// Only a slave acknowledge is meaningful; in receive mode we drive ACK/NACK ourselves
+	if ((I2C0->C1 & I2C_C1_TX_MASK) && (I2C0->S & I2C_S_RXAK_MASK))
+	{
+		I2C_M_STOP;
+		i2c_stats.nacks++;
+		polled_status = I2C_NACK;
+		bus_error = true;
+		return false;
+	}
+	return true;
 }
 
 /*
@@ -145,7 +285,9 @@ void start_I2C()
 uint8_t read_byte_I2C(uint8_t dev)
 {
     uint8_t data;
-	
+
+    begin_polled_I2C();
+    uint32_t start = cycle_count();
     I2C_TRAN;        // Set to transmit mode
     I2C_M_START;     // Send start
     I2C0->D = dev;   // Send dev address
@@ -163,6 +305,10 @@ uint8_t read_byte_I2C(uint8_t dev)
 
     I2C_M_STOP;      // Send stop
     data = I2C0->D;  // Read data
+    if (bus_error)
+        data = 0;    // Nothing was read, do not let callers spin on a busy flag
+    record_trace_I2C(dev, I2C_TRACE_READ, 1, start, bus_error ? polled_status : I2C_DONE);
+    end_polled_I2C();
 
     return data;
 }
@@ -178,6 +324,8 @@ uint8_t read_byte_I2C(uint8_t dev)
  */
 void write_byte_I2C(uint8_t dev, uint8_t data)
 {
+	begin_polled_I2C();
+	uint32_t start = cycle_count();
 	I2C_TRAN;							/*set to transmit mode */
 	I2C_M_START;					/*send start	*/
 	I2C0->D = dev;			  /*send dev address	*/
@@ -186,4 +334,708 @@ void write_byte_I2C(uint8_t dev, uint8_t data)
 	I2C0->D = data;				/*send data	*/
 	I2C_WAIT
 	I2C_M_STOP;
+	record_trace_I2C(dev, I2C_TRACE_WRITE, 1, start, bus_error ? polled_status : I2C_DONE);
+	end_polled_I2C();
+}
+
+/*
+ * This function programs the I2C frequency divider for the fastest SCL rate that
+ * does not exceed the requested speed at the current bus clock
+ *
+ * Parameters: SCL speed in Hz
+ *
+ * Returns: the SCL rate actually programmed, in Hz
+ *
+ */
+uint32_t set_speed_I2C(uint32_t speed_hz)
+{
+	uint32_t bus_clock = CLOCK_GetBusClkFreq();
+	uint32_t best_rate = 0;
+	uint8_t best_f = I2C_F_MULT(I2C_MULT_SETTINGS - 1) | I2C_F_ICR(I2C_DIVIDER_SETTINGS - 1);
+
+	for (uint8_t mult = 0; mult < I2C_MULT_SETTINGS; mult++)
+	{
+		for (uint8_t icr = 0; icr < I2C_DIVIDER_SETTINGS; icr++)
+		{
+			uint32_t rate = bus_clock / ((uint32_t)scl_divider[icr] << mult);
+			if ((rate <= speed_hz) && (rate > best_rate))
+			{
+				best_rate = rate;
+				best_f = I2C_F_MULT(mult) | I2C_F_ICR(icr);
+			}
+		}
+	}
+
+	I2C0->F = best_f;
+	bus_speed_hz = speed_hz;
+	return best_rate;
+}
+
+/*
+ * This function returns the SCL speed of a profile
+ *
+ * Parameters: the profile
+ *
+ * Returns: speed in Hz
+ *
+ */
+uint32_t profile_speed_I2C(i2c_speed_profile_t profile)
+{
+	switch (profile)
+	{
+	case I2C_SPEED_FAST:
+		return I2C_FAST_SPEED_HZ;
+	case I2C_SPEED_MAX_RELIABLE:
+		return max_reliable_speed_hz;
+	default:
+		return I2C_STANDARD_SPEED_HZ;
+	}
+}
+
+/*
+ * This function switches a device to a speed profile; it applies from its next transfer
+ *
+ * Parameters: the device and the profile
+ *
+ * Returns: none
+ *
+ */
+void set_profile_I2C(i2c_device_t *device, i2c_speed_profile_t profile)
+{
+	device->speed_hz = profile_speed_I2C(profile);
+}
+
+/*
+ * This function applies the speed and timeout of a device before talking to it
+ *
+ * Parameters: the device
+ *
+ * Returns: none
+ *
+ */
+static void select_device(const i2c_device_t *device)
+{
+	if (device->speed_hz != bus_speed_hz)
+		set_speed_I2C(device->speed_hz);
+	byte_timeout_us = device->timeout_us;
+}
+
+/*
+ * This function returns the trace direction of a transaction
+ *
+ * Parameters: number of bytes written and read
+ *
+ * Returns: the direction
+ *
+ */
+static i2c_trace_direction_t trace_direction(uint16_t tx_length, uint16_t rx_length)
+{
+	if (rx_length == 0)
+		return I2C_TRACE_WRITE;
+	return (tx_length == 0) ? I2C_TRACE_READ : I2C_TRACE_WRITE_READ;
+}
+
+/*
+ * This function runs a complete polled transaction: an optional write phase, then an
+ * optional read phase after a repeated start, between a single START and STOP
+ *
+ * Parameters: the device, bytes to write and their number, buffer to read into and its length
+ *
+ * Returns: true on success, false on timeout, NACK or arbitration loss
+ *
+ */
+static bool transfer_polled(const i2c_device_t *device, const uint8_t *tx_data, uint16_t tx_length,
+		uint8_t *rx_data, uint16_t rx_length)
+{
+	bool success;
+
+	begin_polled_I2C();
+	uint32_t start = cycle_count();
+	select_device(device);
+	wait_bus_free();
+
+	I2C_TRAN;										// Set to transmit mode
+	I2C_M_START;									// Send start
+	if ((tx_length > 0) || (rx_length == 0))
+	{
+		I2C0->D = device->address;					// Send dev address (write)
+		wait_I2C();
+		for (uint16_t i = 0; (i < tx_length) && !bus_error; i++)
+		{
+			I2C0->D = tx_data[i];					// Send data
+			wait_I2C();
+		}
+		if ((rx_length > 0) && !bus_error)
+			I2C_M_RSTART;							// Repeated start for the read
+	}
+
+	if ((rx_length > 0) && !bus_error)
+	{
+		I2C0->D = device->address | I2C_READ_BIT;	// Send dev address (read)
+		wait_I2C();
+		if (!bus_error)
+		{
+			I2C_REC;								// Set to receive mode
+			if (rx_length == 1)
+				NACK;
+			else
+				ACK;
+			(void)I2C0->D;							// Dummy read starts the first byte
+			for (uint16_t i = 0; i < rx_length; i++)
+			{
+				if (!wait_I2C())
+					break;
+				// NACK the last byte and stop before reading it
+				if (i == (rx_length - 1))
+					I2C_M_STOP;
+				else if (i == (rx_length - 2))
+					NACK;
+				rx_data[i] = I2C0->D;
+			}
+		}
+	}
+
+	I2C_M_STOP;										// Send stop
+	ACK;
+	success = !bus_error;
+	record_trace_I2C(device->address, trace_direction(tx_length, rx_length), tx_length + rx_length, start,
+			success ? I2C_DONE : polled_status);
+	end_polled_I2C();
+	return success;
+}
+
+/*
+ * This function writes a block of bytes to the device in one transaction
+ *
+ * Parameters: the device, bytes to write and their number
+ *
+ * Returns: true on success, false on timeout, NACK or arbitration loss
+ *
+ */
+bool write_burst_I2C(const i2c_device_t *device, const uint8_t *data, uint16_t length)
+{
+	return transfer_polled(device, data, length, NULL, 0);
+}
+
+/*
+ * This function reads a block of bytes from the device in one transaction
+ *
+ * Parameters: the device, buffer to read into and its length
+ *
+ * Returns: true on success, false on timeout, NACK or arbitration loss
+ *
+ */
+bool read_burst_I2C(const i2c_device_t *device, uint8_t *data, uint16_t length)
+{
+	return transfer_polled(device, NULL, 0, data, length);
+}
+
+/*
+ * This function writes bytes (typically a register address) and reads the reply
+ * after a repeated start, in one transaction
+ *
+ * Parameters: the device, bytes to write and their number, buffer to read into and its length
+ *
+ * Returns: true on success, false on timeout, NACK or arbitration loss
+ *
+ */
+bool write_read_I2C(const i2c_device_t *device, const uint8_t *tx_data, uint16_t tx_length,
+		uint8_t *rx_data, uint16_t rx_length)
+{
+	return transfer_polled(device, tx_data, tx_length, rx_data, rx_length);
+}
+
+/*
+ * This function tries increasing speeds against a device that reads back what was
+ * written to it (such as a PCF8574 port), and remembers the fastest error-free speed
+ * as the maximum reliable profile. The device speed is restored afterwards
+ *
+ * Parameters: the device, the bytes to write and read back, their number and
+ *             I2C_SPEED_TEST_STEPS results
+ *
+ * Returns: fastest error-free speed in Hz, 0 if none passed
+ *
+ */
+uint32_t speed_test_I2C(i2c_device_t *device, const uint8_t *patterns, uint8_t pattern_count,
+		i2c_speed_result_t *results)
+{
+	uint32_t saved_speed_hz = device->speed_hz;
+	uint32_t fastest_hz = 0;
+	bool failed = false;
+
+	for (uint8_t step = 0; step < I2C_SPEED_TEST_STEPS; step++)
+	{
+		device->speed_hz = test_speed_hz[step];
+		results[step].requested_hz = test_speed_hz[step];
+		results[step].actual_hz = set_speed_I2C(test_speed_hz[step]);
+		results[step].errors = 0;
+
+		for (uint16_t round = 0; round < I2C_SPEED_TEST_ROUNDS; round++)
+		{
+			uint8_t written = patterns[round % pattern_count];
+			uint8_t read = ~written;
+			if (!write_burst_I2C(device, &written, 1) || !read_burst_I2C(device, &read, 1) || (read != written))
+				results[step].errors++;
+		}
+
+		// Speeds above the first failing one are not trusted even if they pass
+		if (results[step].errors != 0)
+			failed = true;
+		else if (!failed)
+			fastest_hz = test_speed_hz[step];
+	}
+
+	device->speed_hz = saved_speed_hz;
+	if (fastest_hz != 0)
+		max_reliable_speed_hz = fastest_hz;
+	return fastest_hz;
+}
+
+/*
+ * This function takes the next queued transaction onto the bus. Called with
+ * interrupts masked or from an I2C interrupt
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+static void start_next(void)
+{
+	if ((current != NULL) || (polled_depth != 0) || (queue_count == 0))
+		return;
+
+	current = queue[queue_head];
+	queue_head = (queue_head + 1) % I2C_QUEUE_LENGTH;
+	queue_count--;
+	current->status = I2C_IN_PROGRESS;
+	byte_index = 0;
+
+	// Wait for the previous stop to free the bus
+	select_device(current->device);
+	wait_bus_free();
+	transaction_start = cycle_count();
+	transaction_timeout = US_TO_CYCLES(current->device->timeout_us * (current->tx_length + current->rx_length + 2));
+
+	I2C0->S = I2C_S_IICIF_MASK | I2C_S_ARBL_MASK;
+	I2C0->C1 |= I2C_C1_IICIE_MASK;
+	ACK;
+	I2C_TRAN;
+	I2C_M_START;
+	if ((current->tx_length == 0) && (current->rx_length > 0))
+	{
+		engine_state = ENGINE_READ_ADDRESS;
+		I2C0->D = current->device->address | I2C_READ_BIT;
+	}
+	else
+	{
+		engine_state = ENGINE_WRITE;
+		I2C0->D = current->device->address;
+	}
+}
+
+/*
+ * This function ends the transaction on the bus, reports it and starts the next one
+ *
+ * Parameters: status of the transaction
+ *
+ * Returns: none
+ *
+ */
+static void finish_transaction(i2c_status_t status)
+{
+	i2c_transaction_t *transaction = current;
+
+	if (status == I2C_NACK)
+		i2c_stats.nacks++;
+	else if (status == I2C_ARBITRATION_LOST)
+		i2c_stats.arbitration_lost++;
+
+	I2C_M_STOP;
+	I2C0->C1 &= ~(I2C_C1_IICIE_MASK | I2C_C1_TXAK_MASK | I2C_C1_DMAEN_MASK);
+	engine_state = ENGINE_IDLE;
+	current = NULL;
+
+	record_trace_I2C(transaction->device->address, trace_direction(transaction->tx_length, transaction->rx_length),
+			transaction->tx_length + transaction->rx_length, transaction_start, status);
+
+	transaction->status = status;
+	if (transaction->callback != NULL)
+		transaction->callback(transaction);
+
+	start_next();
+}
+
+/*
+ * This function hands the rest of the write phase to the DMA. The CPU sends the first
+ * data byte, every following byte is requested by the I2C transfer complete flag
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+static void start_dma_write(void)
+{
+	uint16_t remaining = current->tx_length - 1;
+
+	engine_state = ENGINE_WRITE_DMA;
+	I2C0->C1 &= ~I2C_C1_IICIE_MASK;
+
+	DMA0->DMA[I2C_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_DONE_MASK;
+	DMA0->DMA[I2C_DMA_CHANNEL].SAR = (uint32_t)&current->tx_buffer[1];
+	DMA0->DMA[I2C_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_BCR(remaining);
+	DMA0->DMA[I2C_DMA_CHANNEL].DCR = DMA_DCR_EINT_MASK | DMA_DCR_ERQ_MASK | DMA_DCR_CS_MASK | DMA_DCR_SINC_MASK |
+			DMA_DCR_SSIZE(DMA_8_BIT) | DMA_DCR_DSIZE(DMA_8_BIT) | DMA_DCR_D_REQ_MASK;
+
+	// Writing the data register clears the transfer complete flag of the address byte,
+	// so the first DMA request comes from this byte
+	I2C0->D = current->tx_buffer[0];
+	I2C0->C1 |= I2C_C1_DMAEN_MASK;
+	byte_index = current->tx_length;
+}
+
+/*
+ * This function runs the state machine after an address or data byte was sent
+ *
+ * Parameters: the I2C status register
+ *
+ * Returns: none
+ *
+ */
+static void step_transmit(uint8_t status)
+{
+	if (status & I2C_S_RXAK_MASK)
+	{
+		finish_transaction(I2C_NACK);
+	}
+	else if ((engine_state == ENGINE_WRITE) && (byte_index == 0) && (current->tx_length >= I2C_DMA_MIN_LENGTH))
+	{
+		start_dma_write();
+	}
+	else if ((engine_state == ENGINE_WRITE) && (byte_index < current->tx_length))
+	{
+		I2C0->D = current->tx_buffer[byte_index++];
+	}
+	else if ((engine_state == ENGINE_WRITE) && (current->rx_length > 0))
+	{
+		// Repeated start for the read phase
+		engine_state = ENGINE_READ_ADDRESS;
+		I2C_M_RSTART;
+		I2C0->D = current->device->address | I2C_READ_BIT;
+	}
+	else if (engine_state == ENGINE_READ_ADDRESS)
+	{
+		// Switch to receive; the dummy read clocks in the first byte
+		engine_state = ENGINE_READ;
+		byte_index = 0;
+		I2C_REC;
+		if (current->rx_length == 1)
+			NACK;
+		else
+			ACK;
+		(void)I2C0->D;
+	}
+	else
+	{
+		finish_transaction(I2C_DONE);
+	}
+}
+
+/*
+ * This function runs the state machine for one I2C interrupt
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+static void step_engine(void)
+{
+	uint8_t status = I2C0->S;
+
+	// While the DMA feeds the data register the flag is only a DMA request
+	if ((current == NULL) || (engine_state == ENGINE_WRITE_DMA))
+		return;
+
+	I2C0->S = I2C_S_IICIF_MASK;			// Clear interrupt flag
+
+	if (status & I2C_S_ARBL_MASK)
+	{
+		I2C0->S = I2C_S_ARBL_MASK;		// Clear arbitration lost flag
+		finish_transaction(I2C_ARBITRATION_LOST);
+		return;
+	}
+
+	if (I2C0->C1 & I2C_C1_TX_MASK)
+	{
+		step_transmit(status);
+		return;
+	}
+
+	// Byte received: NACK the last one and stop before reading it
+	uint16_t remaining = current->rx_length - byte_index;
+	if (remaining == 1)
+		I2C_M_STOP;
+	else if (remaining == 2)
+		NACK;
+	current->rx_buffer[byte_index++] = I2C0->D;
+
+	if (byte_index == current->rx_length)
+		finish_transaction(I2C_DONE);
+}
+
+/*
+ * This function finishes a DMA write phase: it waits for the last byte to leave the
+ * shift register and continues the state machine
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+static void step_dma(void)
+{
+	DMA0->DMA[I2C_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_DONE_MASK;
+	if ((current == NULL) || (engine_state != ENGINE_WRITE_DMA))
+		return;
+
+	I2C0->C1 &= ~I2C_C1_DMAEN_MASK;
+	uint32_t start = cycle_count();
+	while (!(I2C0->S & I2C_S_TCF_MASK))		// At most one byte time
+	{
+		if ((cycle_count() - start) > US_TO_CYCLES(byte_timeout_us))
+		{
+			i2c_stats.timeouts++;
+			recover_I2C();
+			finish_transaction(I2C_TIMEOUT);
+			return;
+		}
+	}
+
+	uint8_t status = I2C0->S;
+	I2C0->S = I2C_S_IICIF_MASK;
+	engine_state = ENGINE_WRITE;
+	I2C0->C1 |= I2C_C1_IICIE_MASK;
+
+	if (status & I2C_S_ARBL_MASK)
+	{
+		I2C0->S = I2C_S_ARBL_MASK;
+		finish_transaction(I2C_ARBITRATION_LOST);
+		return;
+	}
+	step_transmit(status);
+}
+
+/*
+ * This function queues a transaction for the interrupt driven engine. The
+ * transaction must stay valid until its status is no longer pending or in progress
+ *
+ * Parameters: the transaction
+ *
+ * Returns: true if queued, false if the queue is full
+ *
+ */
+bool submit_transaction_I2C(i2c_transaction_t *transaction)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	if (queue_count == I2C_QUEUE_LENGTH)
+	{
+		__set_PRIMASK(primask);
+		transaction->status = I2C_QUEUE_FULL;
+		return false;
+	}
+
+	transaction->status = I2C_PENDING;
+	queue[queue_tail] = transaction;
+	queue_tail = (queue_tail + 1) % I2C_QUEUE_LENGTH;
+	queue_count++;
+	start_next();
+
+	__set_PRIMASK(primask);
+	return true;
+}
+
+/*
+ * This function tells whether the interrupt driven engine has nothing to do
+ *
+ * Parameters: none
+ *
+ * Returns: true if no transaction is queued or in progress
+ *
+ */
+bool is_idle_I2C(void)
+{
+	return (current == NULL) && (queue_count == 0);
+}
+
+/*
+ * This function claims the bus for the polled helpers. It waits for the engine to
+ * finish its current transaction; queued ones are held until end_polled_I2C()
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void begin_polled_I2C(void)
+{
+	while (1)
+	{
+		uint32_t primask = __get_PRIMASK();
+		__disable_irq();
+		if (current == NULL)
+		{
+			polled_depth++;
+			__set_PRIMASK(primask);
+			return;
+		}
+		__set_PRIMASK(primask);
+
+		poll_timeout_I2C();
+		// Inside another handler the engine interrupts may not preempt us, so step the engine here
+		if (__get_IPSR() != 0)
+		{
+			if (DMA0->DMA[I2C_DMA_CHANNEL].DSR_BCR & DMA_DSR_BCR_DONE_MASK)
+				step_dma();
+			else if (I2C0->S & I2C_S_IICIF_MASK)
+				step_engine();
+		}
+	}
+}
+
+/*
+ * This function releases the bus claimed by begin_polled_I2C() and restarts the engine
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void end_polled_I2C(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if (polled_depth > 0)
+		polled_depth--;
+	if (polled_depth == 0)
+		byte_timeout_us = I2C_TIMEOUT_US;
+	if ((polled_depth == 0) && bus_error)
+	{
+		// A repeated start issued after the failure may have flagged arbitration loss
+		bus_error = false;
+		I2C0->C1 &= ~(I2C_C1_MST_MASK | I2C_C1_TX_MASK | I2C_C1_TXAK_MASK);
+		I2C0->S = I2C_S_IICIF_MASK | I2C_S_ARBL_MASK;
+	}
+	start_next();
+	__set_PRIMASK(primask);
+}
+
+/*
+ * This function aborts the transaction on the bus if it has run past its timeout,
+ * recovers the bus and moves on to the next one
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void poll_timeout_I2C(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if ((current != NULL) && ((cycle_count() - transaction_start) > transaction_timeout))
+	{
+		i2c_stats.timeouts++;
+		recover_I2C();
+		finish_transaction(I2C_TIMEOUT);
+	}
+	__set_PRIMASK(primask);
+}
+
+/*
+ * This function returns the bus error counters
+ *
+ * Parameters: none
+ *
+ * Returns: pointer to the counters
+ *
+ */
+const i2c_stats_t *stats_I2C(void)
+{
+	return &i2c_stats;
+}
+
+/*
+ * This function clears the bus error counters
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void reset_stats_I2C(void)
+{
+	i2c_stats.timeouts = 0;
+	i2c_stats.arbitration_lost = 0;
+	i2c_stats.nacks = 0;
+	i2c_stats.recoveries = 0;
+}
+
+/*
+ * This function returns the CPU cycles spent in the engine interrupts since the last reset
+ *
+ * Parameters: none
+ *
+ * Returns: cycles
+ *
+ */
+uint32_t cpu_cycles_I2C(void)
+{
+	return cpu_cycles;
+}
+
+/*
+ * This function resets the CPU cycle counter of the engine interrupts
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void reset_cpu_cycles_I2C(void)
+{
+	cpu_cycles = 0;
+}
+
+/*
+ * I2C0 interrupt handler - runs the transaction state machine
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void I2C0_IRQHandler(void)
+{
+	uint32_t start = cycle_count();
+	step_engine();
+	cpu_cycles += cycle_count() - start;
+}
+
+/*
+ * DMA channel 0 interrupt handler - end of a DMA write phase
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void DMA0_IRQHandler(void)
+{
+	uint32_t start = cycle_count();
+	step_dma();
+	cpu_cycles += cycle_count() - start;
 }
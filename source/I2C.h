@@ -22,7 +22,11 @@
 * 2) ESF/NXP/Misc at master (https://github.com/alexander-g-dean/ESF/tree/master/NXP/Code)
 */
 
+#ifndef I2C_H_
+#define I2C_H_
+
 #include <stdint.h>
+#include <stdbool.h>
 
 #define I2C_M_START 	I2C0->C1 |= I2C_C1_MST_MASK
 #define I2C_M_STOP  	I2C0->C1 &= ~I2C_C1_MST_MASK
@@ -38,17 +42,206 @@
 #define NACK 	        I2C0->C1 |= I2C_C1_TXAK_MASK
 #define ACK           	I2C0->C1 &= ~I2C_C1_TXAK_MASK
 
+#define I2C_QUEUE_LENGTH (8)
+#define I2C_DMA_MIN_LENGTH (8)		// Writes at least this long are fed to I2C0 by the DMA
+#define I2C_TIMEOUT_US (1000)		// Longest wait for one byte before the bus is considered stuck
+#define I2C_STANDARD_SPEED_HZ (100000)
+#define I2C_FAST_SPEED_HZ (400000)
+#define I2C_DEFAULT_SPEED_HZ (I2C_STANDARD_SPEED_HZ)
+#define I2C_SPEED_TEST_STEPS (8)
+#define I2C_SPEED_TEST_ROUNDS (50)
+
+// Status of a queued transaction
+typedef enum {
+	I2C_IDLE = 0,
+	I2C_PENDING,
+	I2C_IN_PROGRESS,
+	I2C_DONE,
+	I2C_NACK,
+	I2C_ARBITRATION_LOST,
+	I2C_TIMEOUT,
+	I2C_QUEUE_FULL
+} i2c_status_t;
+
+// Bus error counters
+typedef struct {
+	uint32_t timeouts;
+	uint32_t arbitration_lost;
+	uint32_t nacks;
+	uint32_t recoveries;
+} i2c_stats_t;
+
+/* Structure for a device on the bus
+*   address is the device address (write form, e.g. 0x4E)
+*   speed_hz is the SCL rate used while talking to the device
+*   timeout_us is the longest wait for one byte
+*/
+typedef struct {
+	uint8_t address;
+	uint32_t speed_hz;
+	uint32_t timeout_us;
+} i2c_device_t;
+
+// Speed profiles for a device
+typedef enum {
+	I2C_SPEED_STANDARD = 0,		// 100 kHz
+	I2C_SPEED_FAST,				// 400 kHz
+	I2C_SPEED_MAX_RELIABLE		// Fastest speed that passed the bus self-test
+} i2c_speed_profile_t;
+
+// Result of the bus self-test at one speed
+typedef struct {
+	uint32_t requested_hz;
+	uint32_t actual_hz;
+	uint16_t errors;
+} i2c_speed_result_t;
+
+struct i2c_transaction_s;
+
+// Function pointer for the completion callback, called from the I2C0 interrupt
+typedef void (*i2c_callback_t)(struct i2c_transaction_s *transaction);
+
+/* Structure for a queued transaction, owned by the caller until it completes
+*   device is the addressed device
+*   tx_buffer/tx_length are written first, then rx_buffer/rx_length are read after
+*   a repeated start. Either length may be zero
+*/
+typedef struct i2c_transaction_s {
+	const i2c_device_t *device;
+	const uint8_t *tx_buffer;
+	uint16_t tx_length;
+	uint8_t *rx_buffer;
+	uint16_t rx_length;
+	i2c_callback_t callback;
+	void *context;
+	volatile i2c_status_t status;
+} i2c_transaction_t;
+
 void init_I2C(void);
 
 /*
- * This function waits for transmission to complete
+ * This function queues a transaction for the interrupt driven engine. The
+ * transaction must stay valid until its status is no longer pending or in progress
+ *
+ * Parameters: the transaction
+ *
+ * Returns: true if queued, false if the queue is full
+ *
+ */
+bool submit_transaction_I2C(i2c_transaction_t *transaction);
+
+/*
+ * This function tells whether the interrupt driven engine has nothing to do
+ *
+ * Parameters: none
+ *
+ * Returns: true if no transaction is queued or in progress
+ *
+ */
+bool is_idle_I2C(void);
+
+/*
+ * This function claims the bus for the polled helpers. It waits for the engine to
+ * finish its current transaction; queued ones are held until end_polled_I2C()
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void begin_polled_I2C(void);
+
+/*
+ * This function releases the bus claimed by begin_polled_I2C() and restarts the engine
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void end_polled_I2C(void);
+
+/*
+ * This function aborts the transaction on the bus if it has run past its timeout,
+ * recovers the bus and moves on to the next one
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void poll_timeout_I2C(void);
+
+/*
+ * This function returns the bus error counters
+ *
+ * Parameters: none
+ *
+ * Returns: pointer to the counters
+ *
+ */
+const i2c_stats_t *stats_I2C(void);
+
+/*
+ * This function clears the bus error counters
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void reset_stats_I2C(void);
+
+/*
+ * This function returns the CPU cycles spent in the engine interrupts since the last reset
+ *
+ * Parameters: none
+ *
+ * Returns: cycles
+ *
+ */
+uint32_t cpu_cycles_I2C(void);
+
+/*
+ * This function resets the CPU cycle counter of the engine interrupts
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void reset_cpu_cycles_I2C(void);
+
+/*
+ * I2C0 interrupt handler - runs the transaction state machine
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void I2C0_IRQHandler(void);
+
+/*
+ * DMA channel 0 interrupt handler - end of a DMA write phase
  *
  * Parameters: none
  *
  * Returns: none
  *
  */
-void wait_I2C(void);
+void DMA0_IRQHandler(void);
+
+/*
+ * This function waits for transmission to complete. After a timeout the bus is
+ * recovered, after a NACK a stop is sent, and the rest of the polled transaction is skipped
+ *
+ * Parameters: none
+ *
+ * Returns: true on success, false on timeout, NACK or arbitration loss
+ *
+ */
+bool wait_I2C(void);
 
 /*
  * This function sends the I2C start sequence
@@ -80,3 +273,82 @@ uint8_t read_byte_I2C(uint8_t dev);
  *
  */
 void write_byte_I2C(uint8_t dev, uint8_t data);
+
+/*
+ * This function programs the I2C frequency divider for the fastest SCL rate that
+ * does not exceed the requested speed at the current bus clock
+ *
+ * Parameters: SCL speed in Hz
+ *
+ * Returns: the SCL rate actually programmed, in Hz
+ *
+ */
+uint32_t set_speed_I2C(uint32_t speed_hz);
+
+/*
+ * This function returns the SCL speed of a profile
+ *
+ * Parameters: the profile
+ *
+ * Returns: speed in Hz
+ *
+ */
+uint32_t profile_speed_I2C(i2c_speed_profile_t profile);
+
+/*
+ * This function switches a device to a speed profile; it applies from its next transfer
+ *
+ * Parameters: the device and the profile
+ *
+ * Returns: none
+ *
+ */
+void set_profile_I2C(i2c_device_t *device, i2c_speed_profile_t profile);
+
+/*
+ * This function tries increasing speeds against a device that reads back what was
+ * written to it (such as a PCF8574 port), and remembers the fastest error-free speed
+ * as the maximum reliable profile. The device speed is restored afterwards
+ *
+ * Parameters: the device, the bytes to write and read back, their number and
+ *             I2C_SPEED_TEST_STEPS results
+ *
+ * Returns: fastest error-free speed in Hz, 0 if none passed
+ *
+ */
+uint32_t speed_test_I2C(i2c_device_t *device, const uint8_t *patterns, uint8_t pattern_count,
+		i2c_speed_result_t *results);
+
+/*
+ * This function writes a block of bytes to the device in one transaction
+ *
+ * Parameters: the device, bytes to write and their number
+ *
+ * Returns: true on success, false on timeout, NACK or arbitration loss
+ *
+ */
+bool write_burst_I2C(const i2c_device_t *device, const uint8_t *data, uint16_t length);
+
+/*
+ * This function reads a block of bytes from the device in one transaction
+ *
+ * Parameters: the device, buffer to read into and its length
+ *
+ * Returns: true on success, false on timeout, NACK or arbitration loss
+ *
+ */
+bool read_burst_I2C(const i2c_device_t *device, uint8_t *data, uint16_t length);
+
+/*
+ * This function writes bytes (typically a register address) and reads the reply
+ * after a repeated start, in one transaction
+ *
+ * Parameters: the device, bytes to write and their number, buffer to read into and its length
+ *
+ * Returns: true on success, false on timeout, NACK or arbitration loss
+ *
+ */
+bool write_read_I2C(const i2c_device_t *device, const uint8_t *tx_data, uint16_t tx_length,
+		uint8_t *rx_data, uint16_t rx_length);
+
+#endif /* I2C_H_ */
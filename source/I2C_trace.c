@@ -0,0 +1,241 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Trapti Damodar Balgi
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Trapti Damodar Balgi and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+* @file I2C_trace.c
+* @brief
+*
+* Optional trace of I2C transactions with per device latency histograms
+*
+* @author Trapti Damodar Balgi
+* @date 13th December 2023
+* @version 1.0
+*/
+
+#include <MKL25Z4.H>
+#include <string.h>
+#include "timers.h"
+#include "I2C.h"
+#include "I2C_trace.h"
+
+#if I2C_TRACE_ENABLE
+
+static i2c_trace_entry_t ring[I2C_TRACE_LENGTH];
+static uint16_t ring_next = 0, ring_count = 0;
+static uint32_t overwritten = 0;
+static i2c_trace_device_t devices[I2C_TRACE_DEVICES];
+static uint8_t device_count = 0;
+static volatile bool trace_on = true;
+
+/*
+ * This function returns the latency histogram bucket for a duration
+ *
+ * Parameters: duration in us
+ *
+ * Returns: bucket index
+ *
+ */
+static uint8_t latency_bucket(uint32_t us)
+{
+	uint8_t bucket = 0;
+	while ((us >>= 1) != 0 && bucket < (I2C_LATENCY_BUCKETS - 1))
+	{
+		bucket++;
+	}
+	return bucket;
+}
+
+/*
+ * This function finds the statistics of a device, adding it if there is room
+ *
+ * Parameters: device address
+ *
+ * Returns: the statistics, NULL if the table is full
+ *
+ */
+static i2c_trace_device_t *find_device(uint8_t address)
+{
+	for (uint8_t i = 0; i < device_count; i++)
+	{
+		if (devices[i].address == address)
+			return &devices[i];
+	}
+	if (device_count == I2C_TRACE_DEVICES)
+		return NULL;
+
+	memset(&devices[device_count], 0, sizeof(devices[device_count]));
+	devices[device_count].address = address;
+	return &devices[device_count++];
+}
+
+/*
+ * This function records a finished transaction. Safe to call from interrupts
+ *
+ * Parameters: device address, direction, number of data bytes, start cycle count
+ *             and the i2c_status_t of the transaction
+ *
+ * Returns: none
+ *
+ */
+void record_trace_I2C(uint8_t address, i2c_trace_direction_t direction, uint16_t length,
+		uint32_t start, uint8_t status)
+{
+	if (!trace_on)
+		return;
+
+	uint32_t end = cycle_count();
+	uint32_t us = (end - start) / US_TO_CYCLES(1);
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	i2c_trace_entry_t *entry = &ring[ring_next];
+	entry->address = address;
+	entry->direction = direction;
+	entry->status = status;
+	entry->length = length;
+	entry->start = start;
+	entry->end = end;
+	ring_next = (ring_next + 1) % I2C_TRACE_LENGTH;
+	if (ring_count < I2C_TRACE_LENGTH)
+		ring_count++;
+	else
+		overwritten++;
+
+	i2c_trace_device_t *device = find_device(address);
+	if (device != NULL)
+	{
+		device->transactions++;
+		device->bytes += length;
+		device->total_us += us;
+		if (status != I2C_DONE)
+			device->errors++;
+		if (us > device->max_us)
+			device->max_us = us;
+		device->histogram[latency_bucket(us)]++;
+	}
+
+	__set_PRIMASK(primask);
+}
+
+/*
+ * This function turns the recording on or off
+ *
+ * Parameters: true to record
+ *
+ * Returns: none
+ *
+ */
+void set_trace_I2C(bool enable)
+{
+	trace_on = enable;
+}
+
+/*
+ * This function tells whether transactions are being recorded
+ *
+ * Parameters: none
+ *
+ * Returns: true if recording
+ *
+ */
+bool is_trace_on_I2C(void)
+{
+	return trace_on;
+}
+
+/*
+ * This function clears the ring and the device statistics
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void clear_trace_I2C(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	ring_next = 0;
+	ring_count = 0;
+	overwritten = 0;
+	device_count = 0;
+	__set_PRIMASK(primask);
+}
+
+/*
+ * This function copies a traced transaction, oldest first
+ *
+ * Parameters: index from the oldest entry and where to copy it
+ *
+ * Returns: true if the entry exists
+ *
+ */
+bool trace_entry_I2C(uint16_t index, i2c_trace_entry_t *entry)
+{
+	bool found = false;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if (index < ring_count)
+	{
+		*entry = ring[(ring_next + I2C_TRACE_LENGTH - ring_count + index) % I2C_TRACE_LENGTH];
+		found = true;
+	}
+	__set_PRIMASK(primask);
+	return found;
+}
+
+/*
+ * This function copies the statistics of a traced device
+ *
+ * Parameters: index of the device and where to copy it
+ *
+ * Returns: true if the device exists
+ *
+ */
+bool trace_device_I2C(uint8_t index, i2c_trace_device_t *device)
+{
+	bool found = false;
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	if (index < device_count)
+	{
+		*device = devices[index];
+		found = true;
+	}
+	__set_PRIMASK(primask);
+	return found;
+}
+
+/*
+ * This function returns the number of transactions that did not fit in the ring
+ *
+ * Parameters: none
+ *
+ * Returns: number of overwritten entries
+ *
+ */
+uint32_t trace_overwritten_I2C(void)
+{
+	return overwritten;
+}
+
+#else
+
+void record_trace_I2C(uint8_t address, i2c_trace_direction_t direction, uint16_t length,
+		uint32_t start, uint8_t status) {}
+void set_trace_I2C(bool enable) {}
+bool is_trace_on_I2C(void) { return false; }
+void clear_trace_I2C(void) {}
+bool trace_entry_I2C(uint16_t index, i2c_trace_entry_t *entry) { return false; }
+bool trace_device_I2C(uint8_t index, i2c_trace_device_t *device) { return false; }
+uint32_t trace_overwritten_I2C(void) { return 0; }
+
+#endif
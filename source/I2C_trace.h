@@ -0,0 +1,140 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Trapti Damodar Balgi
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Trapti Damodar Balgi and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+* @file I2C_trace.h
+* @brief
+*
+* Optional trace of I2C transactions with per device latency histograms
+*
+* @author Trapti Damodar Balgi
+* @date 13th December 2023
+* @version 1.0
+*/
+
+#ifndef I2C_TRACE_H_
+#define I2C_TRACE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Set to 0 to compile the tracer out
+#ifndef I2C_TRACE_ENABLE
+#define I2C_TRACE_ENABLE (1)
+#endif
+
+#define I2C_TRACE_LENGTH (64)			// Transactions kept in the ring
+#define I2C_TRACE_DEVICES (4)			// Devices with their own statistics
+#define I2C_LATENCY_BUCKETS (16)		// Bucket n counts latencies of [2^n, 2^(n+1)) us
+
+// Direction of a traced transaction
+typedef enum {
+	I2C_TRACE_WRITE = 'W',
+	I2C_TRACE_READ = 'R',
+	I2C_TRACE_WRITE_READ = 'X'
+} i2c_trace_direction_t;
+
+/* Structure for one traced transaction
+*   start and end are cycle_count() timestamps
+*   status is an i2c_status_t
+*/
+typedef struct {
+	uint8_t address;
+	uint8_t direction;
+	uint8_t status;
+	uint16_t length;
+	uint32_t start;
+	uint32_t end;
+} i2c_trace_entry_t;
+
+// Structure for the statistics of one device
+typedef struct {
+	uint8_t address;
+	uint32_t transactions;
+	uint32_t bytes;
+	uint32_t errors;
+	uint32_t max_us;
+	uint32_t total_us;
+	uint32_t histogram[I2C_LATENCY_BUCKETS];
+} i2c_trace_device_t;
+
+/*
+ * This function records a finished transaction. Safe to call from interrupts
+ *
+ * Parameters: device address, direction, number of data bytes, start cycle count
+ *             and the i2c_status_t of the transaction
+ *
+ * Returns: none
+ *
+ */
+void record_trace_I2C(uint8_t address, i2c_trace_direction_t direction, uint16_t length,
+		uint32_t start, uint8_t status);
+
+/*
+ * This function turns the recording on or off
+ *
+ * Parameters: true to record
+ *
+ * Returns: none
+ *
+ */
+void set_trace_I2C(bool enable);
+
+/*
+ * This function tells whether transactions are being recorded
+ *
+ * Parameters: none
+ *
+ * Returns: true if recording
+ *
+ */
+bool is_trace_on_I2C(void);
+
+/*
+ * This function clears the ring and the device statistics
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void clear_trace_I2C(void);
+
+/*
+ * This function copies a traced transaction, oldest first
+ *
+ * Parameters: index from the oldest entry and where to copy it
+ *
+ * Returns: true if the entry exists
+ *
+ */
+bool trace_entry_I2C(uint16_t index, i2c_trace_entry_t *entry);
+
+/*
+ * This function copies the statistics of a traced device
+ *
+ * Parameters: index of the device and where to copy it
+ *
+ * Returns: true if the device exists
+ *
+ */
+bool trace_device_I2C(uint8_t index, i2c_trace_device_t *device);
+
+/*
+ * This function returns the number of transactions that did not fit in the ring
+ *
+ * Parameters: none
+ *
+ * Returns: number of overwritten entries
+ *
+ */
+uint32_t trace_overwritten_I2C(void);
+
+#endif /* I2C_TRACE_H_ */
@@ -28,14 +28,18 @@
 
 #include "MKL25Z4.h"
 #include "core_cm0plus.h"
+#include <string.h>
 #include "I2C.h"
 #include "LCD.h"
+#include "timers.h"
 
 #define LCD_ADDRESS (0x4E)
 
 #define LCD_MOVE_CURSOR (0x02)
 #define LCD_ENABLE_4BIT (0x28)
 #define LCD_DISPLAY_ON (0x0F)
+#define LCD_SHIFT_DISPLAY_LEFT (0x18)
+#define LCD_SET_DDRAM (0x80)
 
 #define LCD_ROW_1 (0xC0)
 #define LCD_ROW_2 (0x94)
@@ -52,9 +56,97 @@
 
 #define ENABLE_LOW (data &= ~(0b00000100))
 
+#define DDRAM_LINE_LENGTH (40)
+#define DDRAM_LINE_1 (0x40)
+#define DDRAM_ADDRESS_MASK (0x7F)
+
+#define MARQUEE_GAP (4)
+
+#define BYTES_PER_LCD_TRANSFER (4)		// E high and E low for each nibble
+#define REFRESH_STREAM_LENGTH (LCD_ROWS * (LCD_COLUMNS + 1) * BYTES_PER_LCD_TRANSFER)
+
+#define BACKLIGHT (0b1000)
+#define SPEED_TEST_PATTERNS (4)
+
+#define LCD_INSTRUCTION_DELAY (500)
+#define LCD_SLOW_INSTRUCTION_DELAY (2000)
+
+// Structure for the marquee
+typedef struct {
+	bool active;
+	bool exclusive;
+	uint8_t row;
+	uint8_t shift;
+	uint16_t length;
+	uint16_t position;
+	ticktime_t period;
+	ticktime_t next;
+	char text[LCD_MARQUEE_MAX_LENGTH];
+} marquee_t;
+
 volatile int num_chars = 0;
 volatile bool lcd_flag = 0;
 
+// Copy of the DDRAM contents for the visible cells and the current address counter
+static char frame_buffer[LCD_ROWS][LCD_COLUMNS];
+static uint8_t ddram_address = 0;
+
+static marquee_t marquee;
+
+// The PCF8574 backpack
+i2c_device_t lcd_device = {
+	.address = LCD_ADDRESS,
+	.speed_hz = I2C_DEFAULT_SPEED_HZ,
+	.timeout_us = I2C_TIMEOUT_US
+};
+
+// DDRAM address of the first cell of each row
+static const uint8_t row_address[LCD_ROWS] = {0x00, 0x40, 0x14, 0x54};
+
+/*
+ * This function tracks the DDRAM address counter and the frame buffer for every
+ * byte sent to the LCD
+ *
+ * Parameters: type of command sent and the contents of the command
+ *
+ * Returns: none
+ *
+ */
+static void track_lcd (uint8_t type, uint8_t byte)
+{
+	if (type == INSTRUCTION_COMMAND)
+	{
+		if (byte & LCD_SET_DDRAM)
+		{
+			ddram_address = byte & DDRAM_ADDRESS_MASK;
+		}
+		else if (byte == LCD_CLEAR_DISPLAY)
+		{
+			memset(frame_buffer, ' ', sizeof(frame_buffer));
+			ddram_address = 0;
+		}
+		else if (byte == LCD_MOVE_CURSOR)
+		{
+			ddram_address = 0;
+		}
+		return;
+	}
+
+	// Map the address to a visible cell: rows 0 & 2 share line 0, rows 1 & 3 share line 1
+	uint8_t line = (ddram_address >= DDRAM_LINE_1);
+	uint8_t index = ddram_address - (line ? DDRAM_LINE_1 : 0);
+	if (index < DDRAM_LINE_LENGTH)
+	{
+		frame_buffer[line + ((index >= LCD_COLUMNS) ? 2 : 0)][index % LCD_COLUMNS] = byte;
+	}
+
+	// The address counter wraps from the end of one line to the start of the other
+	if (++index >= DDRAM_LINE_LENGTH)
+		ddram_address = line ? 0 : DDRAM_LINE_1;
+	else
+		ddram_address = (line ? DDRAM_LINE_1 : 0) + index;
+}
+
 /*
  * This function is to initialize the LCD
  *
@@ -76,6 +168,25 @@ void init_LCD(void)
     delay_ms(500);
 }
 
+/*
+ * This function encodes one instruction or data byte as the four PCF8574 writes
+ * that clock it into the LCD in 4-bit mode
+ *
+ * Parameters: type of command, contents of the command and destination
+ *
+ * Returns: none
+ *
+ */
+static void encode_lcd(uint8_t type, uint8_t byte, uint8_t *out)
+{
+	uint8_t data = (byte & 0xF0) | type;
+	out[0] = data;
+	out[1] = ENABLE_LOW;
+	data = ((byte & 0x0F) << 4) | type;
+	out[2] = data;
+	out[3] = ENABLE_LOW;
+}
+
 /*
  * This function is a general function to send a data or instruction command to the LCD
  *
@@ -86,41 +197,19 @@ void init_LCD(void)
  */
 void send_lcd (uint8_t type, uint8_t byte)
 {
-	uint8_t upper_nibble = (byte & 0xF0) >> 4; // Extract upper nibble
-	uint8_t lower_nibble = byte & 0x0F;        // Extract lower nibble
-	uint8_t data = (upper_nibble << 4) | type;
-
-	I2C_TRAN;      		// Set to transmit mode
-	I2C_M_START;   		// Send start
-	I2C0->D = LCD_ADDRESS;   	// Send dev address
-	I2C_WAIT;       	// Wait for ack
+	uint8_t stream[BYTES_PER_LCD_TRANSFER];
 
-	// Send upper nibble
-	// Send E high
-	I2C0->D = data; 	 // Send data
-	I2C_WAIT;
-	delay_ms(500);
+	track_lcd(type, byte);
 
-	// Send E low
-	ENABLE_LOW;
-	I2C0->D = data;  	 // Send data
-	I2C_WAIT;
-	delay_ms(500);
+	// Both nibbles with their enable pulses in a single transaction
+	encode_lcd(type, byte, stream);
+	write_burst_I2C(&lcd_device, stream, BYTES_PER_LCD_TRANSFER);
 
-	data = 0;
-	// Send lower nibble
-	// Send E high
-	data = (lower_nibble << 4) | type;
-	I2C0->D = data;  	 // Send data
-	I2C_WAIT;
-	delay_ms(500);
-
-	// Send E low
-	ENABLE_LOW;
-	I2C0->D = data;  	// Send data
-	I2C_WAIT;
-	I2C_M_STOP;
-	delay_ms(500);
+	// Clear and return home take over a millisecond to execute
+	if ((type == INSTRUCTION_COMMAND) && ((byte == LCD_CLEAR_DISPLAY) || (byte == LCD_MOVE_CURSOR)))
+		delay_ms(LCD_SLOW_INSTRUCTION_DELAY);
+	else
+		delay_ms(LCD_INSTRUCTION_DELAY);
 }
 
 /*
@@ -226,3 +315,261 @@ void print_data_lcd(uint8_t integral, uint8_t decimal)
 	digit = decimal % 10;
 	put_char_lcd(digit + '0');
 }
+
+/*
+ * This function writes a run of characters at a row and column, sending only the
+ * cells that differ from what is already on the display
+ *
+ * Parameters: row, column, characters and number of characters
+ *
+ * Returns: none
+ *
+ */
+void write_lcd_at(uint8_t row, uint8_t column, const char *str, uint8_t length)
+{
+	if (row >= LCD_ROWS)
+		return;
+
+	for (uint8_t i = 0; (i < length) && ((column + i) < LCD_COLUMNS); i++)
+	{
+		if (frame_buffer[row][column + i] == str[i])
+			continue;
+
+		// Only move the cursor when the cell is not the next one anyway
+		uint8_t address = row_address[row] + column + i;
+		if (ddram_address != address)
+			send_command_lcd(LCD_SET_DDRAM | address);
+		send_lcd(DATA_COMMAND, str[i]);
+	}
+}
+
+/*
+ * This function returns the character of the scrolling message at a position,
+ * with a gap of blanks between repetitions
+ *
+ * Parameters: position in the message
+ *
+ * Returns: the character
+ *
+ */
+static char marquee_char(uint32_t position)
+{
+	position %= (marquee.length + MARQUEE_GAP);
+	return (position < marquee.length) ? marquee.text[position] : ' ';
+}
+
+/*
+ * This function draws the software marquee window on its row
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+static void draw_marquee(void)
+{
+	char window[LCD_COLUMNS];
+	for (uint8_t i = 0; i < LCD_COLUMNS; i++)
+	{
+		window[i] = marquee_char(marquee.position + i);
+	}
+	write_lcd_at(marquee.row, 0, window, LCD_COLUMNS);
+}
+
+/*
+ * This function starts scrolling a message on the LCD. An exclusive marquee takes
+ * over the display and scrolls with the HD44780 display shift instruction, otherwise
+ * the message scrolls in software on its row and the rest of the display is kept
+ *
+ * Parameters: row, message, scroll period in ms and whether the display is exclusive
+ *
+ * Returns: none
+ *
+ */
+void start_marquee_lcd(uint8_t row, const char *str, uint16_t period_ms, bool exclusive)
+{
+	stop_marquee_lcd();
+	if ((row >= LCD_ROWS) || (str == NULL))
+		return;
+
+	for (marquee.length = 0; (marquee.length < LCD_MARQUEE_MAX_LENGTH) && (str[marquee.length] != '\0'); marquee.length++)
+	{
+		marquee.text[marquee.length] = str[marquee.length];
+	}
+	if (marquee.length == 0)
+		return;
+	marquee.row = row;
+	marquee.exclusive = exclusive;
+	marquee.position = 0;
+	marquee.shift = 0;
+	marquee.period = MS_TO_TICKS(period_ms);
+	marquee.next = now() + marquee.period;
+
+	if (exclusive)
+	{
+		// Fill the 40 cells of line 0 (rows 0 and 2) once, the display shift does the rest
+		send_command_lcd(LCD_CLEAR_DISPLAY);
+		while (read_byte_I2C(LCD_ADDRESS) & 0x80);   // Busy wait
+		send_command_lcd(LCD_MOVE_CURSOR);
+		for (uint8_t i = 0; i < DDRAM_LINE_LENGTH; i++)
+		{
+			send_lcd(DATA_COMMAND, marquee_char(i));
+		}
+	}
+	else
+	{
+		draw_marquee();
+	}
+	marquee.active = true;
+}
+
+/*
+ * This function stops the marquee. An exclusive marquee clears the display and
+ * restores the display shift
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void stop_marquee_lcd(void)
+{
+	if (!marquee.active)
+		return;
+
+	marquee.active = false;
+	if (marquee.exclusive)
+	{
+		marquee.exclusive = false;
+		send_command_lcd(LCD_CLEAR_DISPLAY);
+		while (read_byte_I2C(LCD_ADDRESS) & 0x80);   // Busy wait
+		send_command_lcd(LCD_MOVE_CURSOR);           // Also undoes the display shift
+	}
+}
+
+/*
+ * This function advances the marquee by one step once its period has elapsed.
+ * It must be called periodically from the main context and never blocks
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void marquee_task_lcd(void)
+{
+	if (!marquee.active || ((int32_t)(now() - marquee.next) < 0))
+		return;
+
+	marquee.next += marquee.period;
+	marquee.position++;
+
+	if (marquee.exclusive)
+	{
+		// One shift plus the cell that just left the window: refill it with the
+		// character that becomes visible again 40 steps later
+		send_command_lcd(LCD_SHIFT_DISPLAY_LEFT);
+		send_command_lcd(LCD_SET_DDRAM | marquee.shift);
+		send_lcd(DATA_COMMAND, marquee_char(marquee.position + DDRAM_LINE_LENGTH - 1));
+		marquee.shift = (marquee.shift + 1) % DDRAM_LINE_LENGTH;
+	}
+	else
+	{
+		draw_marquee();
+	}
+}
+
+/*
+ * This function tells whether an exclusive marquee currently owns the display
+ *
+ * Parameters: none
+ *
+ * Returns: true if an exclusive marquee is running
+ *
+ */
+bool marquee_exclusive_lcd(void)
+{
+	return marquee.active && marquee.exclusive;
+}
+
+/*
+ * This function encodes the whole display, row by row, as one I2C write
+ *
+ * Parameters: destination of REFRESH_STREAM_LENGTH bytes
+ *
+ * Returns: number of bytes
+ *
+ */
+static uint16_t build_refresh_lcd(uint8_t *stream)
+{
+	uint16_t length = 0;
+	for (uint8_t row = 0; row < LCD_ROWS; row++)
+	{
+		encode_lcd(INSTRUCTION_COMMAND, LCD_SET_DDRAM | row_address[row], &stream[length]);
+		length += BYTES_PER_LCD_TRANSFER;
+		for (uint8_t column = 0; column < LCD_COLUMNS; column++)
+		{
+			encode_lcd(DATA_COMMAND, frame_buffer[row][column], &stream[length]);
+			length += BYTES_PER_LCD_TRANSFER;
+		}
+	}
+	return length;
+}
+
+/*
+ * This function redraws the 80 characters of the display twice, once with the polled
+ * I2C helpers and once through the DMA engine, and measures the CPU cycles of each
+ *
+ * Parameters: where to store the polled and DMA cycle counts
+ *
+ * Returns: none
+ *
+ */
+void benchmark_refresh_lcd(uint32_t *polled_cycles, uint32_t *dma_cycles)
+{
+	static uint8_t stream[REFRESH_STREAM_LENGTH];
+	uint16_t length = build_refresh_lcd(stream);
+	uint32_t start;
+
+	// Polled: the CPU waits on every byte
+	start = cycle_count();
+	write_burst_I2C(&lcd_device, stream, length);
+	*polled_cycles = cycle_count() - start;
+
+	// DMA: the CPU only queues the transfer and runs the interrupts around it
+	i2c_transaction_t transaction = {
+		.device = &lcd_device,
+		.tx_buffer = stream,
+		.tx_length = length,
+	};
+	reset_cpu_cycles_I2C();
+	start = cycle_count();
+	submit_transaction_I2C(&transaction);
+	*dma_cycles = cycle_count() - start;
+	while ((transaction.status == I2C_PENDING) || (transaction.status == I2C_IN_PROGRESS))
+	{
+		poll_timeout_I2C();
+	}
+	*dma_cycles += cpu_cycles_I2C();
+
+	// The address counter wraps to 0x00 after the last cell of row 3
+	ddram_address = 0;
+}
+
+/*
+ * This function runs the I2C bus self-test against the LCD backpack. Patterns are
+ * written with E low so the display ignores them, and read back from the PCF8574
+ *
+ * Parameters: I2C_SPEED_TEST_STEPS results
+ *
+ * Returns: fastest error-free speed in Hz, 0 if none passed
+ *
+ */
+uint32_t speed_test_lcd(i2c_speed_result_t *results)
+{
+	// Data nibble varies, backlight on, E, RW and RS low
+	static const uint8_t patterns[SPEED_TEST_PATTERNS] = {
+		0x00 | BACKLIGHT, 0xF0 | BACKLIGHT, 0xA0 | BACKLIGHT, 0x50 | BACKLIGHT
+	};
+	return speed_test_I2C(&lcd_device, patterns, SPEED_TEST_PATTERNS, results);
+}
@@ -31,12 +31,20 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "I2C.h"
 
 #define LCD_ROW_0 (0x80)
 #define LCD_CLEAR_DISPLAY (0x01)
 
+#define LCD_ROWS (4)
+#define LCD_COLUMNS (20)
+
+#define LCD_MARQUEE_MAX_LENGTH (250)
+#define LCD_MARQUEE_PERIOD_MS (300)
+
 extern volatile int num_chars;
 extern volatile bool lcd_flag;
+extern i2c_device_t lcd_device;
 
 /*
  * This function is to initialize the LCD
@@ -98,4 +106,81 @@ void put_char_lcd(char);
  */
 void print_data_lcd(uint8_t, uint8_t);
 
+/*
+ * This function writes a run of characters at a row and column, sending only the
+ * cells that differ from what is already on the display
+ *
+ * Parameters: row, column, characters and number of characters
+ *
+ * Returns: none
+ *
+ */
+void write_lcd_at(uint8_t row, uint8_t column, const char *str, uint8_t length);
+
+/*
+ * This function starts scrolling a message on the LCD. An exclusive marquee takes
+ * over the display and scrolls with the HD44780 display shift instruction, otherwise
+ * the message scrolls in software on its row and the rest of the display is kept
+ *
+ * Parameters: row, message, scroll period in ms and whether the display is exclusive
+ *
+ * Returns: none
+ *
+ */
+void start_marquee_lcd(uint8_t row, const char *str, uint16_t period_ms, bool exclusive);
+
+/*
+ * This function stops the marquee. An exclusive marquee clears the display and
+ * restores the display shift
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void stop_marquee_lcd(void);
+
+/*
+ * This function advances the marquee by one step once its period has elapsed.
+ * It must be called periodically from the main context and never blocks
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void marquee_task_lcd(void);
+
+/*
+ * This function tells whether an exclusive marquee currently owns the display
+ *
+ * Parameters: none
+ *
+ * Returns: true if an exclusive marquee is running
+ *
+ */
+bool marquee_exclusive_lcd(void);
+
+/*
+ * This function redraws the 80 characters of the display twice, once with the polled
+ * I2C helpers and once through the DMA engine, and measures the CPU cycles of each
+ *
+ * Parameters: where to store the polled and DMA cycle counts
+ *
+ * Returns: none
+ *
+ */
+void benchmark_refresh_lcd(uint32_t *polled_cycles, uint32_t *dma_cycles);
+
+/*
+ * This function runs the I2C bus self-test against the LCD backpack. Patterns are
+ * written with E low so the display ignores them, and read back from the PCF8574
+ *
+ * Parameters: I2C_SPEED_TEST_STEPS results
+ *
+ * Returns: fastest error-free speed in Hz, 0 if none passed
+ *
+ */
+uint32_t speed_test_lcd(i2c_speed_result_t *results);
+
 #endif /* LCD_H_ */
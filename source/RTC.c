@@ -165,6 +165,10 @@ void clock_update (void)
     time[MIN_1] = minutes/10 + '0';
     time[HOURS] = hours + '0';
 
+    // The display belongs to the marquee, the clock is redrawn once it stops
+    if (marquee_exclusive_lcd())
+        return;
+
     // Flag for DDRAM address not to be updated
     lcd_flag = 1;
     // Set cursor position
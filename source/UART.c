@@ -27,16 +27,18 @@
 #include "UART.h"
 #include <stdio.h>
 #include "cbfifo.h"
+#include "fsl_lpsci.h"
+#include "timers.h"
+#include "fsl_clock.h"
+#include "telemetry.h"
 
 // UART macros
-#define UART_OVERSAMPLE_RATE (16)
-#define BUS_CLOCK (24e6)
-#define SYS_CLOCK (24e6)
-#define UART_BAUD_RATE (38400)
-#define NINE_DATA_BIT_MODE (1)
-#define PARITY_ENABLE (1)
-#define ODD_PARITY (1)
-#define TWO_STOP_BITS (1)
+#define MIN_OVERSAMPLE_RATE (4)
+#define MAX_OVERSAMPLE_RATE (32)
+#define BOTH_EDGE_OVERSAMPLE_RATE (8)	// Rates below this need sampling on both edges
+#define MAX_SBR (0x1FFF)
+#define UART_DRAIN_TIMEOUT_MS (500)
+#define UART_RX_ERROR_MASK (UART0_S1_OR_MASK | UART0_S1_NF_MASK | UART0_S1_FE_MASK | UART0_S1_PF_MASK)
 #define RX_ENABLE (1)
 #define TX_ENABLE (1)
 #define RX_INT_ENABLE (1)
@@ -48,10 +50,145 @@
 #define ERROR (-1)
 #define NO_ERROR (0)
 
+#define UART_DMA_CHANNEL (1)
+#define UART_DMA_SOURCE (3)			// DMAMUX request source for UART0 transmit
+#define UART_DMA_IRQ_PRIORITY (2)
+#define DMA_8_BIT (1)
+
+// Line settings in use, and the ones to go back to if a change is not confirmed
+static uart_config_t current_config = UART_DEFAULT_CONFIG;
+static uart_config_t fallback_config = UART_DEFAULT_CONFIG;
+static uint32_t current_baud_rate = 0;
+static bool confirm_pending = false;
+static ticktime_t confirm_start = 0;
+
+// What __sys_write does when txfifo has no room left
+static uart_overflow_t overflow_mode = UART_OVERFLOW_DEFAULT;
+static uint32_t overflow_timeout_ms = UART_WRITE_TIMEOUT_MS;
+static volatile uint32_t dropped_bytes = 0;
+
+#if UART_TX_DMA
+// The DMA reads straight out of txfifo; the bytes of the transfer in progress stay queued until it completes
+static volatile size_t dma_length = 0;
+static volatile bool dma_busy = false;
+static volatile bool dma_hold = false;			// Keeps the channel idle while queued output is dropped
+#endif
+
 
 extern CircularBuffer_t* txfifo;
 extern CircularBuffer_t* rxfifo;
 
+// Set by the receive interrupt, cleared by the terminal before it drains rxfifo
+volatile bool rx_flag = 0;
+static volatile uint32_t rx_dropped = 0;		// Bytes lost to a full rxfifo
+static volatile uint32_t rx_errors = 0;			// Overrun, noise, framing and parity errors
+
+/*
+ * Finds the oversampling ratio and baud divisor that come closest to a baud rate
+ *
+ * Parameters:
+ * 	clock		UART0 clock in Hz
+ * 	baud_rate	Requested baud rate
+ * 	osr			Returns the oversampling ratio, 4 to 32
+ * 	sbr			Returns the baud rate divisor, 1 to 8191
+ *
+ * Returns: the baud rate actually produced, or 0 if none is in range
+ *
+ */
+static uint32_t best_divisors(uint32_t clock, uint32_t baud_rate, uint8_t *osr, uint16_t *sbr)
+{
+	uint32_t best_error = UINT32_MAX;
+	uint32_t best_baud = 0;
+
+	// Walk down so that ties keep the higher, more noise tolerant, oversampling ratio
+	for (uint32_t rate = MAX_OVERSAMPLE_RATE; rate >= MIN_OVERSAMPLE_RATE; rate--)
+	{
+		uint32_t divisor = (clock + (baud_rate * rate) / 2) / (baud_rate * rate);
+		if ((divisor == 0) || (divisor > MAX_SBR))
+			continue;
+
+		uint32_t actual = clock / (rate * divisor);
+		uint32_t error = (actual > baud_rate) ? (actual - baud_rate) : (baud_rate - actual);
+		if (error < best_error)
+		{
+			best_error = error;
+			best_baud = actual;
+			*osr = (uint8_t)rate;
+			*sbr = (uint16_t)divisor;
+		}
+	}
+
+	return best_baud;
+}
+
+/*
+ * Waits until everything queued for transmission has left the shift register
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+static void drain_tx(void)
+{
+	ticktime_t start = now();
+
+	while ((cbfifo_length(txfifo) != 0)
+#if UART_TX_DMA
+			|| dma_busy
+#endif
+			|| !(UART0->S1 & UART0_S1_TC_MASK))
+	{
+		if ((now() - start) > MS_TO_TICKS(UART_DRAIN_TIMEOUT_MS))
+			break;
+	}
+}
+
+/*
+ * Programs the baud rate and frame format with the transmitter and receiver stopped
+ *
+ * Parameters:
+ * 	config	Line settings to apply
+ *
+ * Returns: true if the baud rate can be produced from the UART0 clock
+ *
+ */
+static bool apply_config(const uart_config_t *config)
+{
+	uint8_t osr = 0;
+	uint16_t sbr = 0;
+	uint32_t actual = best_divisors(CLOCK_GetPllFllSelClkFreq(), config->baud_rate, &osr, &sbr);
+
+	if ((actual == 0) || ((config->data_bits != 7) && (config->data_bits != 8)) || ((config->stop_bits != 1) && (config->stop_bits != 2)))
+		return false;
+	// Seven data bits only exist as eight bit frames with the parity bit
+	if ((config->data_bits == 7) && (config->parity == UART_PARITY_NONE))
+		return false;
+
+	uint8_t enabled = UART0->C2 & (UART0_C2_TE_MASK | UART0_C2_RE_MASK);
+	UART0->C2 &= ~(UART0_C2_TE_MASK | UART0_C2_RE_MASK);
+
+	// Set baud rate and oversampling ratio
+	UART0->BDH = UART0_BDH_SBR(sbr >> 8) | UART0_BDH_SBNS(config->stop_bits == 2);
+	UART0->BDL = UART0_BDL_SBR(sbr);
+	UART0->C4 = (UART0->C4 & ~UART0_C4_OSR_MASK) | UART0_C4_OSR(osr - 1);
+	if (osr < BOTH_EDGE_OVERSAMPLE_RATE)
+		UART0->C5 |= UART0_C5_BOTHEDGE_MASK;
+	else
+		UART0->C5 &= ~UART0_C5_BOTHEDGE_MASK;
+
+	// The parity bit takes the place of the last data bit, so 8 data bits with parity needs 9 bit mode
+	bool parity = (config->parity != UART_PARITY_NONE);
+	UART0->C1 = UART0_C1_M(parity && (config->data_bits == 8)) | UART0_C1_PE(parity) |
+			UART0_C1_PT(config->parity == UART_PARITY_ODD);
+
+	UART0->C2 |= enabled;
+
+	current_config = *config;
+	current_baud_rate = actual;
+	return true;
+}
+
 /*
  * Intialization of UART0
  *
@@ -64,8 +201,8 @@ extern CircularBuffer_t* rxfifo;
  */
 void init_UART0()
 {
-	uint32_t baud_rate = UART_BAUD_RATE;
-	uint16_t sbr;
+	const uart_config_t config = UART_DEFAULT_CONFIG;
+
 	// Enable clock gating for UART0 and Port A
 	SIM->SCGC4 |= SIM_SCGC4_UART0_MASK;
 	SIM->SCGC5 |= SIM_SCGC5_PORTA_MASK;
@@ -73,7 +210,7 @@ void init_UART0()
 	// Make sure transmitter and receiver are disabled before init
 	UART0->C2 &= ~UART0_C2_TE_MASK & ~UART0_C2_RE_MASK;
 
-	// Set UART clock to 24MHz clock
+	// Clock UART0 from the PLL/FLL selection; its rate is read back when the divisors are computed
 	SIM->SOPT2 |= SIM_SOPT2_UART0SRC(MCGFLLCLK_MCGPLLCLK_SELECT);
 	SIM->SOPT2 |= SIM_SOPT2_PLLFLLSEL(MCGFLLCLK_SELECT);
 
@@ -81,18 +218,8 @@ void init_UART0()
 	PORTA->PCR[1] = PORT_PCR_ISF_MASK | PORT_PCR_MUX(2); // Rx
 	PORTA->PCR[2] = PORT_PCR_ISF_MASK | PORT_PCR_MUX(2); // Tx
 
-	// Set baud rate and oversampling ratio
-	sbr = (uint16_t)((SYS_CLOCK)/(baud_rate * UART_OVERSAMPLE_RATE));
-	UART0->BDH &= ~UART0_BDH_SBR_MASK;
-	UART0->BDH |= UART0_BDH_SBR(sbr>>8);
-	UART0->BDL = UART0_BDL_SBR(sbr);
-	UART0->C4 |= UART0_C4_OSR(UART_OVERSAMPLE_RATE - 1);
-
-	// Select two stop bits
-	UART0->BDH |= UART0_BDH_SBNS(TWO_STOP_BITS);
-
-	// Use 9 data bit mode, use odd parity
-	UART0->C1 = UART0_C1_M(NINE_DATA_BIT_MODE) | UART0_C1_PE(PARITY_ENABLE) | UART0_C1_PT(ODD_PARITY);
+	// Set baud rate, oversampling ratio and frame format
+	apply_config(&config);
 
 	// Enable interrupt for Rx
 	UART0->C2 = UART0_C2_RIE(RX_INT_ENABLE);
@@ -107,7 +234,161 @@ void init_UART0()
 	NVIC_SetPriority(UART0_IRQn, 2);
 	NVIC_ClearPendingIRQ(UART0_IRQn);
 	NVIC_EnableIRQ(UART0_IRQn);
+
+#if UART_TX_DMA
+	// DMA channel fed by the UART0 transmit request
+	SIM->SCGC6 |= SIM_SCGC6_DMAMUX_MASK;
+	SIM->SCGC7 |= SIM_SCGC7_DMA_MASK;
+	DMAMUX0->CHCFG[UART_DMA_CHANNEL] = 0;
+	DMA0->DMA[UART_DMA_CHANNEL].DAR = (uint32_t)&UART0->D;
+	DMAMUX0->CHCFG[UART_DMA_CHANNEL] = DMAMUX_CHCFG_ENBL_MASK | DMAMUX_CHCFG_SOURCE(UART_DMA_SOURCE);
+	NVIC_SetPriority(DMA1_IRQn, UART_DMA_IRQ_PRIORITY);
+	NVIC_ClearPendingIRQ(DMA1_IRQn);
+	NVIC_EnableIRQ(DMA1_IRQn);
+#endif
+}
+
+/*
+ * Switches UART0 to new line settings. Output already queued is sent with the old settings first.
+ * Unless confirm_UART() is called within UART_CONFIRM_TIMEOUT_MS, poll_confirm_UART() restores the old settings.
+ *
+ * Parameters:
+ * 	config	Line settings to switch to
+ *
+ * Returns: true if the settings were applied, false if the baud rate cannot be produced
+ *
+ */
+bool configure_UART(const uart_config_t *config)
+{
+	uart_config_t previous = current_config;
+
+	drain_tx();
+	if (!apply_config(config))
+		return false;
+
+	// A second change before confirmation still falls back to the last confirmed settings
+	if (!confirm_pending)
+		fallback_config = previous;
+	confirm_pending = true;
+	confirm_start = now();
+	return true;
+}
+
+/*
+ * Keeps the settings applied by configure_UART()
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void confirm_UART(void)
+{
+	confirm_pending = false;
+	fallback_config = current_config;
+}
+
+/*
+ * Restores the previous line settings once an unconfirmed change has timed out. Call from the idle loop.
+ *
+ * Parameters: none
+ *
+ * Returns: true if the settings were restored by this call
+ *
+ */
+bool poll_confirm_UART(void)
+{
+	if (!confirm_pending || ((now() - confirm_start) <= MS_TO_TICKS(UART_CONFIRM_TIMEOUT_MS)))
+		return false;
+
+	confirm_pending = false;
+	// Whatever is still queued was meant for the settings being abandoned
+	drain_tx();
+	apply_config(&fallback_config);
+	return true;
+}
+
+/*
+ * Returns the line settings in use
+ *
+ * Parameters: none
+ *
+ * Returns: pointer to the current settings
+ *
+ */
+const uart_config_t *config_UART(void)
+{
+	return &current_config;
+}
+
+/*
+ * Returns the baud rate actually produced by the current divisors
+ *
+ * Parameters: none
+ *
+ * Returns: baud rate in bits per second
+ *
+ */
+uint32_t actual_baud_UART(void)
+{
+	return current_baud_rate;
+}
+
+#if UART_TX_DMA
+/*
+ * This function starts a DMA transfer of the next span of txfifo if none is running.
+ * Called with interrupts masked or from the DMA interrupt
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+static void start_tx_dma(void)
+{
+	uint8_t *span;
+
+	if (dma_busy || dma_hold)
+		return;
+
+	size_t length = cbfifo_read_span(txfifo, &span);
+	if (length > UART_DMA_CHUNK)
+		length = UART_DMA_CHUNK;
+	if (length == 0)
+	{
+		LPSCI_EnableTxDMA(UART0, false);
+		return;
+	}
+
+	dma_busy = true;
+	dma_length = length;
+	DMA0->DMA[UART_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_DONE_MASK;
+	DMA0->DMA[UART_DMA_CHANNEL].SAR = (uint32_t)span;
+	DMA0->DMA[UART_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_BCR(length);
+	DMA0->DMA[UART_DMA_CHANNEL].DCR = DMA_DCR_EINT_MASK | DMA_DCR_ERQ_MASK | DMA_DCR_CS_MASK | DMA_DCR_SINC_MASK |
+			DMA_DCR_SSIZE(DMA_8_BIT) | DMA_DCR_DSIZE(DMA_8_BIT) | DMA_DCR_D_REQ_MASK;
+
+	// TDRE now raises a DMA request instead of an interrupt
+	LPSCI_EnableTxDMA(UART0, true);
+}
+
+/*
+ * DMA channel 1 interrupt handler - a span of txfifo has been handed to UART0
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void DMA1_IRQHandler(void)
+{
+	// Clearing DONE also clears any configuration or bus error
+	DMA0->DMA[UART_DMA_CHANNEL].DSR_BCR = DMA_DSR_BCR_DONE_MASK;
+	cbfifo_commit_read(txfifo, dma_length);
+	dma_busy = false;
+	start_tx_dma();
 }
+#endif
 
 /*
  * UART0 interrupt handler
@@ -121,19 +402,34 @@ void init_UART0()
  */
 void UART0_IRQHandler(void)
 {
-	uint8_t ch;
+	// An overrun or framing error stops further receive interrupts until it is cleared
+	if (UART0->S1 & UART_RX_ERROR_MASK)
+	{
+		UART0->S1 = UART_RX_ERROR_MASK;
+		rx_errors++;
+	}
+
 	// If character has arrived at the serial port
 	if (UART0->S1 & UART0_S1_RDRF_MASK)
 	{
+		uint8_t *slot;
+		// Reading D clears RDRF, so it is read even when the byte has to be dropped
+		uint8_t ch = UART0->D;
 		// If rxfifo not full
-		if(cbfifo_length(rxfifo) != MAX_BUFFER_SIZE)
+		if (cbfifo_write_span(rxfifo, &slot) != 0)
+		{
+			// Store straight into rxfifo
+			*slot = ch;
+			cbfifo_commit_write(rxfifo, ONE_BYTE);
+			rx_flag = 1;
+		}
+		else
 		{
-			ch = UART0->D;
-			// Enqueue to rxfifo
-			cbfifo_enqueue(&ch, ONE_BYTE, rxfifo);
+			rx_dropped++;
 		}
 	}
 
+#if !UART_TX_DMA
 	// If character is to be sent from the serial port & data register is empty
 	if ((UART0->C2 & UART0_C2_TIE_MASK) && (UART0->S1 & UART0_S1_TDRE_MASK))
 	{
@@ -150,10 +446,219 @@ void UART0_IRQHandler(void)
 			UART0->C2 &= ~UART0_C2_TIE_MASK;
 		}
 	}
+#endif
+}
+
+/*
+ * Starts the transmitter on whatever is queued in txfifo
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+static void kick_tx(void)
+{
+#if UART_TX_DMA
+	// Start the DMA unless a transfer is already running; its completion picks up the rest
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	start_tx_dma();
+	__set_PRIMASK(primask);
+#else
+	// Enable Tx interrupt
+	UART0->C2 |= UART0_C2_TIE(TX_INT_ENABLE);
+#endif
+}
+
+/*
+ * Copies as much of a span as fits into txfifo. The transmit side never needs masking, but an interrupt
+ * that prints is a second producer, so interrupts are masked against that
+ *
+ * Parameters:
+ * 	buf		Bytes to queue
+ * 	length	Number of bytes in buf
+ *
+ * Returns: number of bytes queued
+ *
+ */
+static size_t enqueue_span(const char *buf, size_t length)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	size_t added = cbfifo_enqueue((void *)buf, length, txfifo);
+	__set_PRIMASK(primask);
+
+	return (added == (size_t)ERROR) ? 0 : added;
+}
+
+/*
+ * Discards the oldest queued bytes so that length more bytes fit in txfifo
+ *
+ * Parameters:
+ * 	length	Number of bytes that need room
+ *
+ * Returns: none
+ *
+ */
+static void drop_oldest(size_t length)
+{
+#if UART_TX_DMA
+	// Bytes the DMA is sending cannot be taken back, so let that transfer finish and hold the next one
+	if (dma_busy)
+	{
+		if ((__get_IPSR() != 0) || (__get_PRIMASK() != 0))
+			return;
+		dma_hold = true;
+		while (dma_busy);
+	}
+#endif
+
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+	size_t room = MAX_BUFFER_SIZE - cbfifo_length(txfifo);
+	if (room < length)
+	{
+		size_t count = length - room;
+		if (count > cbfifo_length(txfifo))
+			count = cbfifo_length(txfifo);
+		cbfifo_commit_read(txfifo, count);
+		dropped_bytes += count;
+	}
+	__set_PRIMASK(primask);
+
+#if UART_TX_DMA
+	dma_hold = false;
+#endif
+}
+
+/*
+ * Selects what __sys_write does when txfifo is full
+ *
+ * Parameters:
+ * 	mode		UART_BLOCK, UART_DROP_NEWEST or UART_DROP_OLDEST
+ * 	timeout_ms	Longest UART_BLOCK waits for room before giving up
+ *
+ * Returns: none
+ *
+ */
+void set_overflow_UART(uart_overflow_t mode, uint32_t timeout_ms)
+{
+	overflow_mode = mode;
+	overflow_timeout_ms = timeout_ms;
+}
+
+/*
+ * Returns the number of output bytes discarded because txfifo was full
+ *
+ * Parameters: none
+ *
+ * Returns: count of dropped bytes since reset
+ *
+ */
+uint32_t dropped_UART(void)
+{
+	return dropped_bytes;
+}
+
+/*
+ * Returns the receive side counters
+ *
+ * Parameters:
+ * 	dropped	Returns the bytes lost because rxfifo was full
+ * 	errors	Returns the overrun, noise, framing and parity errors
+ *
+ * Returns: none
+ *
+ */
+void rx_stats_UART(uint32_t *dropped, uint32_t *errors)
+{
+	*dropped = rx_dropped;
+	*errors = rx_errors;
+}
+
+/*
+ * Clears the dropped byte counter
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void reset_dropped_UART(void)
+{
+	dropped_bytes = 0;
+}
+
+/*
+ * Queues bytes for UART0 as they are. A full FIFO is handled as set by set_overflow_UART().
+ *
+ * Parameters:
+ * 	buffer	Bytes to send
+ * 	length	Number of bytes in buffer
+ *
+ * Returns: -1 on error, or 0 on success
+ *
+ */
+int write_UART(const void *buffer, size_t length)
+{
+	const char *pcBuffer = (const char *)buffer;
+	size_t written = 0;
+
+	if (buffer == NULL)
+		return ERROR;
+
+	uart_overflow_t mode = overflow_mode;
+
+	// Waiting for room is only possible while the transmit side can still run
+	if ((mode == UART_BLOCK) && ((__get_IPSR() != 0) || (__get_PRIMASK() != 0)))
+		mode = UART_DROP_NEWEST;
+
+	if (mode == UART_DROP_OLDEST)
+	{
+		// Only the tail of a span larger than the whole FIFO can survive
+		if (length > MAX_BUFFER_SIZE)
+		{
+			dropped_bytes += length - MAX_BUFFER_SIZE;
+			written = length - MAX_BUFFER_SIZE;
+		}
+		drop_oldest(length - written);
+	}
+
+	written += enqueue_span(&pcBuffer[written], length - written);
+
+	if ((written < length) && (mode == UART_BLOCK))
+	{
+		ticktime_t start = now();
+		ticktime_t timeout = MS_TO_TICKS(overflow_timeout_ms);
+
+		// The FIFO only drains once the transmitter is running
+		kick_tx();
+		while (written < length)
+		{
+			written += enqueue_span(&pcBuffer[written], length - written);
+			if ((now() - start) > timeout)
+				break;
+		}
+	}
+
+	kick_tx();
+
+	if (written < length)
+	{
+		dropped_bytes += length - written;
+		// Running out of time is an error; dropping on request is not
+		if (mode == UART_BLOCK)
+			return ERROR;
+	}
+
+	return NO_ERROR;
 }
 
 /*
  * sys_write to redirect output. Write the specified bytes to stdout (handle = 1) or stderr (handle = 2).
+ * Whole spans are copied into txfifo; a full FIFO is handled as set by set_overflow_UART().
+ * In binary telemetry mode the bytes are sent inside text frames.
  * Returns -1 on error, or 0 on success.
  *
  * Parameters: int iFileHandle, char *pcBuffer, int iLength
@@ -163,23 +668,21 @@ void UART0_IRQHandler(void)
  */
 int __sys_write(int iFileHandle, char *pcBuffer, int iLength)
 {
-	unsigned int i;
-	for (i = 0; i < iLength; i++)
+	if ((pcBuffer == NULL) || (iLength < 0))
+		return ERROR;
+
+	if (mode_telemetry() == TELEMETRY_BINARY)
 	{
-		// If txfifo is not empty
-		if(cbfifo_length(txfifo) != MAX_BUFFER_SIZE)
+		for (int i = 0; i < iLength; i += TELEMETRY_MAX_PAYLOAD)
 		{
-			// Add to txfifo
-			cbfifo_enqueue(&pcBuffer[i], ONE_BYTE, txfifo);
+			int length = ((iLength - i) > TELEMETRY_MAX_PAYLOAD) ? TELEMETRY_MAX_PAYLOAD : (iLength - i);
+			if (!send_frame_telemetry(TELEMETRY_FRAME_TEXT, (const uint8_t *)&pcBuffer[i], length))
+				return ERROR;
 		}
-		else
-			return ERROR; 				// Return -1 on error
+		return NO_ERROR;
 	}
 
-	// Enable Tx interrupt
-	UART0->C2 |= UART0_C2_TIE(TX_INT_ENABLE);
-
-	return NO_ERROR;
+	return write_UART(pcBuffer, (size_t)iLength);
 }
 
 /*
@@ -25,6 +25,51 @@
 #ifndef UART_H
 #define UART_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Set to 0 to send from txfifo with one interrupt per byte instead of DMA
+#ifndef UART_TX_DMA
+#define UART_TX_DMA (1)
+#endif
+
+#define UART_DMA_CHUNK (128)		// Largest span of txfifo sent by one DMA transfer
+
+#define UART_WRITE_TIMEOUT_MS (250)	// Longest __sys_write waits for room in UART_BLOCK mode
+#define UART_OVERFLOW_DEFAULT (UART_BLOCK)
+
+#define UART_CONFIRM_TIMEOUT_MS (5000)	// Time the host has to confirm new line settings
+
+typedef enum
+{
+	UART_PARITY_NONE,
+	UART_PARITY_EVEN,
+	UART_PARITY_ODD
+} uart_parity_t;
+
+// Line settings of UART0
+typedef struct
+{
+	uint32_t baud_rate;
+	uint8_t data_bits;			// 7 or 8, not counting the parity bit
+	uart_parity_t parity;
+	uint8_t stop_bits;			// 1 or 2
+} uart_config_t;
+
+// 38400 baud, 8 data bits, odd parity, 2 stop bits
+#define UART_DEFAULT_CONFIG {38400, 8, UART_PARITY_ODD, 2}
+
+// What __sys_write does when txfifo is full
+typedef enum
+{
+	UART_BLOCK,				// Wait for the transmitter to make room, up to a timeout
+	UART_DROP_NEWEST,		// Keep what is queued, discard the rest of the write
+	UART_DROP_OLDEST		// Discard queued output to make room; waits for a DMA transfer in progress
+} uart_overflow_t;
+
+extern volatile bool rx_flag;
+
 /*
  * Intialization of UART0
  *
@@ -49,8 +94,130 @@ void init_UART0 ();
  */
 void UART0_IRQHandler (void);
 
+#if UART_TX_DMA
+/*
+ * DMA channel 1 interrupt handler - a span of txfifo has been handed to UART0
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void DMA1_IRQHandler(void);
+#endif
+
+/*
+ * Switches UART0 to new line settings. Output already queued is sent with the old settings first.
+ * Unless confirm_UART() is called within UART_CONFIRM_TIMEOUT_MS, poll_confirm_UART() restores the old settings.
+ *
+ * Parameters:
+ * 	config	Line settings to switch to
+ *
+ * Returns: true if the settings were applied, false if the baud rate cannot be produced
+ *
+ */
+bool configure_UART(const uart_config_t *config);
+
+/*
+ * Keeps the settings applied by configure_UART()
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void confirm_UART(void);
+
+/*
+ * Restores the previous line settings once an unconfirmed change has timed out. Call from the idle loop.
+ *
+ * Parameters: none
+ *
+ * Returns: true if the settings were restored by this call
+ *
+ */
+bool poll_confirm_UART(void);
+
+/*
+ * Returns the line settings in use
+ *
+ * Parameters: none
+ *
+ * Returns: pointer to the current settings
+ *
+ */
+const uart_config_t *config_UART(void);
+
+/*
+ * Returns the baud rate actually produced by the current divisors
+ *
+ * Parameters: none
+ *
+ * Returns: baud rate in bits per second
+ *
+ */
+uint32_t actual_baud_UART(void);
+
+/*
+ * Selects what __sys_write does when txfifo is full
+ *
+ * Parameters:
+ * 	mode		UART_BLOCK, UART_DROP_NEWEST or UART_DROP_OLDEST
+ * 	timeout_ms	Longest UART_BLOCK waits for room before giving up
+ *
+ * Returns: none
+ *
+ */
+void set_overflow_UART(uart_overflow_t mode, uint32_t timeout_ms);
+
+/*
+ * Returns the number of output bytes discarded because txfifo was full
+ *
+ * Parameters: none
+ *
+ * Returns: count of dropped bytes since reset
+ *
+ */
+uint32_t dropped_UART(void);
+
+/*
+ * Returns the receive side counters
+ *
+ * Parameters:
+ * 	dropped	Returns the bytes lost because rxfifo was full
+ * 	errors	Returns the overrun, noise, framing and parity errors
+ *
+ * Returns: none
+ *
+ */
+void rx_stats_UART(uint32_t *dropped, uint32_t *errors);
+
+/*
+ * Clears the dropped byte counter
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void reset_dropped_UART(void);
+
+/*
+ * Queues bytes for UART0 as they are. A full FIFO is handled as set by set_overflow_UART().
+ *
+ * Parameters:
+ * 	buffer	Bytes to send
+ * 	length	Number of bytes in buffer
+ *
+ * Returns: -1 on error, or 0 on success
+ *
+ */
+int write_UART(const void *buffer, size_t length);
+
 /*
  * sys_write to redirect output. Write the specified bytes to stdout (handle = 1) or stderr (handle = 2).
+ * Whole spans are copied into txfifo; a full FIFO is handled as set by set_overflow_UART().
+ * In binary telemetry mode the bytes are sent inside text frames.
  * Returns -1 on error, or 0 on success.
  *
  * Parameters: int iFileHandle, char *pcBuffer, int iLength
@@ -27,71 +27,140 @@
 #include "UART.h"
 #include "processor.h"
 #include "UART_terminal.h"
+#include "LCD.h"
+#include "I2C.h"
+#include "telemetry.h"
+#include "cbfifo.h"
 
-#define MAX_BUFFER_SIZE (255)
 #define ASCII_BACKSPACE (8)
 #define ASCII_SPACE (32)
 #define ASCII_CARRIAGE_RETURN (13)
 #define ASCII_DELETE (127)
-#define ASCII_NO_CHAR (-1)
 #define ASCII_NULL (0)
+#define ECHO_BUFFER_SIZE (48)
 
 /*
- * Function for the serial terminal - how characters are handled and added to the command buffer
+ * Clears a line editor for the next line
  *
- * Parameters: baud rate
+ * Parameters: the line editor
  *
  * Returns: none
  *
  */
-void UART_terminal(void)
+void reset_line_terminal(line_editor_t *editor)
 {
-    uint8_t ch = 0;
-    char command_buffer[MAX_BUFFER_SIZE];
-    printf("\n\r\t\tReal-Time Environment Monitor with RTC and DHT11\t\t\n\r");
+    editor->length = 0;
+    editor->buffer[0] = ASCII_NULL;
+    editor->state = LINE_EDITING;
+}
 
-    while (1)
+/*
+ * Feeds the bytes waiting in rxfifo to a line editor without blocking. Bytes after a carriage return
+ * stay in rxfifo for the next line.
+ *
+ * Parameters: the line editor
+ *
+ * Returns: true when the line is complete and null terminated in editor->buffer
+ *
+ */
+bool feed_line_terminal(line_editor_t *editor)
+{
+    char echo[ECHO_BUFFER_SIZE];
+    uint8_t echo_length = 0;
+    uint8_t *span;
+    size_t available;
+
+    // Work through rxfifo in place, one contiguous span at a time
+    while ((editor->state == LINE_EDITING) && ((available = cbfifo_read_span(rxfifo, &span)) != 0))
     {
-        printf("\n\n\r$$ ");
+        size_t used = 0;
 
-        uint8_t i = 0;
-        while (i < MAX_BUFFER_SIZE)
+        while ((used < available) && (editor->state == LINE_EDITING))
         {
-            while ((ch = getchar()) == (char)(ASCII_NO_CHAR));
+            char ch = span[used++];
+
+            // Keep room for the longest echo of one byte
+            if (echo_length > ECHO_BUFFER_SIZE - 3)
+            {
+                fwrite(echo, 1, echo_length, stdout);
+                echo_length = 0;
+            }
 
             if (ch == ASCII_CARRIAGE_RETURN)
             {
-                printf("\n\r");
-                command_buffer[i] = ASCII_NULL;
-                break;  // Exit loop when carriage return is encountered
+                echo[echo_length++] = '\n';
+                echo[echo_length++] = '\r';
+                editor->state = LINE_COMPLETE;
             }
             else if ((ch == ASCII_BACKSPACE) || (ch == ASCII_DELETE))
             {
-                if (i > 0)
+                if (editor->length > 0)
                 {
-                    putchar(ASCII_BACKSPACE);
-                    putchar(ASCII_SPACE);
-                    putchar(ASCII_BACKSPACE);
-                    command_buffer[--i] = ASCII_NULL;
+                    echo[echo_length++] = ASCII_BACKSPACE;
+                    echo[echo_length++] = ASCII_SPACE;
+                    echo[echo_length++] = ASCII_BACKSPACE;
+                    editor->length--;
                 }
             }
             else
             {
-                putchar(ch);
-                if (i == (MAX_BUFFER_SIZE -1))
+                echo[echo_length++] = ch;
+                editor->buffer[editor->length++] = ch;
+                if (editor->length == (TERMINAL_LINE_LENGTH - 1))
                 {
+                    fwrite(echo, 1, echo_length, stdout);
+                    echo_length = 0;
                     printf("\n\rMaximum limit of buffer reached. Cannot add more commands, sending for processing.");
-                    command_buffer[i] = ch;
-                    break;  // Exit loop when buffer limit reached
-                }
-                else
-                {
-                    command_buffer[i++] = ch;
+                    editor->state = LINE_COMPLETE;
                 }
             }
         }
-        command_buffer[MAX_BUFFER_SIZE - 1] = ASCII_NULL;  // Ensure null termination
 
-        process_command(command_buffer);
+        cbfifo_commit_read(rxfifo, used);
+    }
+
+    if (echo_length > 0)
+        fwrite(echo, 1, echo_length, stdout);
+
+    editor->buffer[editor->length] = ASCII_NULL;  // Ensure null termination
+    return (editor->state == LINE_COMPLETE);
+}
+
+/*
+ * Function for the serial terminal - runs the line editor on receive events and the background tasks in between
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void UART_terminal(void)
+{
+    static line_editor_t editor;
+
+    printf("\n\r\t\tReal-Time Environment Monitor with RTC and DHT11\t\t\n\r");
+    printf("\n\n\r$$ ");
+    reset_line_terminal(&editor);
+
+    while (1)
+    {
+        // Consume whatever the receive interrupt has queued since the last pass
+        if (rx_flag)
+        {
+            rx_flag = 0;
+            if (feed_line_terminal(&editor))
+            {
+                process_command(editor.buffer);
+                reset_line_terminal(&editor);
+                printf("\n\n\r$$ ");
+                rx_flag = 1;  // Bytes typed after the carriage return are still queued
+            }
+        }
+
+        marquee_task_lcd();  // Keep the display scrolling while idle
+        poll_timeout_I2C();
+        if (poll_confirm_UART())
+            printf("\n\rLine settings not confirmed, restored\n\r$$ %s", editor.buffer);
+        task_telemetry();
     }
 }
@@ -25,10 +25,48 @@
 #ifndef UART_TERMINAL_H_
 #define UART_TERMINAL_H_
 
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TERMINAL_LINE_LENGTH (255)
+
+typedef enum {
+	LINE_EDITING,				// Collecting characters
+	LINE_COMPLETE				// Carriage return received or buffer full
+} line_state_t;
+
+// Structure for the line editor state
+typedef struct {
+	char buffer[TERMINAL_LINE_LENGTH];
+	uint8_t length;
+	line_state_t state;
+} line_editor_t;
+
+/*
+ * Clears a line editor for the next line
+ *
+ * Parameters: the line editor
+ *
+ * Returns: none
+ *
+ */
+void reset_line_terminal(line_editor_t *editor);
+
+/*
+ * Feeds the bytes waiting in rxfifo to a line editor without blocking. Bytes after a carriage return
+ * stay in rxfifo for the next line.
+ *
+ * Parameters: the line editor
+ *
+ * Returns: true when the line is complete and null terminated in editor->buffer
+ *
+ */
+bool feed_line_terminal(line_editor_t *editor);
+
 /*
- * Function for the serial terminal - how characters are handled and added to the command buffer
+ * Function for the serial terminal - runs the line editor on receive events and the background tasks in between
  *
- * Parameters: baud rate
+ * Parameters: none
  *
  * Returns: none
  *
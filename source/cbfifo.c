@@ -10,7 +10,7 @@
 
 /**
  * @file    cbfifo.c
- * @brief   The cbfifo implementation will allow cbfifo creation, with a size of 127 bytes which is statically allocated. 
+ * @brief   The cbfifo implementation will allow cbfifo creation, with a power of two size which is statically allocated. 
  *
  *
  * @author  Trapti Damodar Balgi
@@ -20,109 +20,135 @@
 #include "cbfifo.h"
 #include <stdint.h>
 #include <stdio.h>
-#include <string.h>  //for memset
+#include <string.h>  //for memcpy
 
-#define MIN_BUFFER_SIZE 0
 #define ERROR (-1)
-#define ZERO 0
 
-/*Structure for circular buffer
-*   buffer is the circular buffer where bytes will be enqueued and dequeued
-*   size is the number of bytes of data currently in the CBFIFO
-*   front is the position of the read pointer
-*   rear is the position of the write pointer
+/* Index accesses. Each index has one writer, so no read-modify-write is ever shared.
+*   LOAD_OWN      the index this side writes, nobody else changes it
+*   LOAD_OTHER    the index the other side writes; acquire, so the buffer is only touched after it
+*   PUBLISH       release, so the buffer accesses before it are complete when the other side sees it
+* On the single core Cortex-M0+ these keep the compiler (and the bus, through DMB) in order against the ISR;
+* on a host they also order two threads.
 */
+#define LOAD_OWN(index) __atomic_load_n(&(index), __ATOMIC_RELAXED)
+#define LOAD_OTHER(index) __atomic_load_n(&(index), __ATOMIC_ACQUIRE)
+#define PUBLISH(index, value) __atomic_store_n(&(index), (value), __ATOMIC_RELEASE)
+
 // Initialize the fifos
-CircularBuffer_t txfifo_struct = { .buffer = {0}, .size = 0, .front = 0, .rear = 0};
+CircularBuffer_t txfifo_struct = { .buffer = {0}, .head = 0, .tail = 0};
 CircularBuffer_t* txfifo = &txfifo_struct;
-CircularBuffer_t rxfifo_struct = { .buffer = {0}, .size = 0, .front = 0, .rear = 0};
+CircularBuffer_t rxfifo_struct = { .buffer = {0}, .head = 0, .tail = 0};
 CircularBuffer_t* rxfifo = &rxfifo_struct;
 
 size_t cbfifo_enqueue(void *buf, size_t nbyte, CircularBuffer_t* cbfifo)
 {
-    uint8_t added_bytes = 0;                //Number of bytes added to the buffer
-
-    //Check for invalid values
-    if ( (buf == NULL) || (cbfifo->size < ZERO) || (cbfifo->size > MAX_BUFFER_SIZE) || (cbfifo->front < ZERO) || (cbfifo->front > MAX_BUFFER_SIZE) || (cbfifo->rear < ZERO) || (cbfifo->rear > MAX_BUFFER_SIZE) )
+    if ( (buf == NULL) || (cbfifo == NULL) )
     {
         return ( (size_t) ERROR);
     }
-    
-    //If max size reached or nbyte <= 0
-    if ( (cbfifo->size == (MAX_BUFFER_SIZE)) || !(nbyte > ZERO) )
-    {
-        return (added_bytes);
-    }
 
-    uint8_t *int_buf = (uint8_t*)buf;       //typecasted to int pointer
-    
-    //while the cbfifo can still enqueue and bytes are yet to be added
-    while( (cbfifo->size < MAX_BUFFER_SIZE) && (added_bytes < nbyte) && (added_bytes < MAX_BUFFER_SIZE) && (cbfifo->rear < MAX_BUFFER_SIZE) )
-    {
-            cbfifo->buffer[cbfifo->rear] = int_buf[added_bytes];                    //add data to the cbfifo
-            cbfifo->rear = ( ((cbfifo->rear) + 1) == (MAX_BUFFER_SIZE)) ? 0 : ((cbfifo->rear) + 1);           //if rear is not 127, increment by 1, else make zero
-            (cbfifo->size)++;   
-            added_bytes++;
-    }
-    
-    //If valid
-    if( (cbfifo->size >= ZERO) && (cbfifo->size <= MAX_BUFFER_SIZE) && (cbfifo->front >= ZERO) && (cbfifo->front < MAX_BUFFER_SIZE) && (cbfifo->rear >= ZERO) && (cbfifo->rear < MAX_BUFFER_SIZE) )
-        return added_bytes;
-    else 
-        return ZERO;
+    uint8_t *byte_buf = (uint8_t*)buf;
+    uint32_t head = LOAD_OWN(cbfifo->head);
+    size_t space = CBFIFO_CAPACITY - (head - LOAD_OTHER(cbfifo->tail));
+    size_t offset = head & CBFIFO_MASK;
+
+    if (nbyte > space)
+        nbyte = space;
+
+    //Copy up to the end of the buffer, then the rest from the start
+    size_t first = CBFIFO_CAPACITY - offset;
+    if (first > nbyte)
+        first = nbyte;
+    memcpy(&cbfifo->buffer[offset], byte_buf, first);
+    memcpy(cbfifo->buffer, &byte_buf[first], nbyte - first);
 
+    //Publish the bytes only once they are in the buffer
+    PUBLISH(cbfifo->head, head + nbyte);
+
+    return nbyte;
 }
 
 size_t cbfifo_dequeue(void *buf, size_t nbyte, CircularBuffer_t* cbfifo)
 {
-    uint8_t removed_bytes = 0;      //Number of bytes removed from the counter
-
-    //Check for invalid values
-    if ( (buf == NULL) || (cbfifo->size < ZERO) || (cbfifo->size > MAX_BUFFER_SIZE) || (cbfifo->front < ZERO) || (cbfifo->front > MAX_BUFFER_SIZE) || (cbfifo->rear < ZERO) || (cbfifo->rear > MAX_BUFFER_SIZE) )                        
+    if ( (buf == NULL) || (cbfifo == NULL) )
     {
         return ( (size_t) ERROR);
     }
-    
-    //If min size reached or nbyte <= 0
-    if ( ((cbfifo->size) == (MIN_BUFFER_SIZE)) || !(nbyte > ZERO) )
-    {
-        return 0;
-    }
-    
-    uint8_t *int_buf = (uint8_t*)buf;
 
-    //while the cbfifo can still dequeue and bytes are yet to be taken away
-    while( (cbfifo->size > MIN_BUFFER_SIZE) && (removed_bytes < nbyte) && (removed_bytes < MAX_BUFFER_SIZE) && (cbfifo->front < MAX_BUFFER_SIZE) && (cbfifo->front < MAX_BUFFER_SIZE))
-    {
-        int_buf[removed_bytes] = cbfifo->buffer[cbfifo->front];
-        cbfifo->buffer[cbfifo->front] = 0;       //Overwrite to 0
-        cbfifo->front = ((cbfifo->front) + 1 == MAX_BUFFER_SIZE) ? 0 : ((cbfifo->front) + 1);           //if front is not 127, increment by 1, else make zero
-        (cbfifo->size)--;
-        removed_bytes++;
-    }
+    uint8_t *byte_buf = (uint8_t*)buf;
+    uint32_t tail = LOAD_OWN(cbfifo->tail);
+    size_t length = LOAD_OTHER(cbfifo->head) - tail;
+    size_t offset = tail & CBFIFO_MASK;
+
+    if (nbyte > length)
+        nbyte = length;
+
+    //Copy up to the end of the buffer, then the rest from the start
+    size_t first = CBFIFO_CAPACITY - offset;
+    if (first > nbyte)
+        first = nbyte;
+    memcpy(byte_buf, &cbfifo->buffer[offset], first);
+    memcpy(&byte_buf[first], cbfifo->buffer, nbyte - first);
 
-    //If valid
-    if( (cbfifo->size >= ZERO) && (cbfifo->size >= MIN_BUFFER_SIZE) && (cbfifo->front >= ZERO) && (cbfifo->front < MAX_BUFFER_SIZE) && (cbfifo->rear >= ZERO) && (cbfifo->rear < MAX_BUFFER_SIZE) )
-        return removed_bytes;
-    else 
-        return ZERO;
+    //Hand the slots back only once they have been read
+    PUBLISH(cbfifo->tail, tail + nbyte);
 
+    return nbyte;
+}
+
+size_t cbfifo_read_span(CircularBuffer_t* cbfifo, uint8_t **span)
+{
+    uint32_t tail = LOAD_OWN(cbfifo->tail);
+    size_t length = LOAD_OTHER(cbfifo->head) - tail;
+    size_t offset = tail & CBFIFO_MASK;
+
+    *span = &cbfifo->buffer[offset];
+
+    //Stop at the end of the buffer; the rest is the next span
+    if (length > CBFIFO_CAPACITY - offset)
+        length = CBFIFO_CAPACITY - offset;
+    return length;
+}
+
+void cbfifo_commit_read(CircularBuffer_t* cbfifo, size_t nbyte)
+{
+    //Hand the slots back only once they have been read
+    PUBLISH(cbfifo->tail, LOAD_OWN(cbfifo->tail) + nbyte);
+}
+
+size_t cbfifo_write_span(CircularBuffer_t* cbfifo, uint8_t **span)
+{
+    uint32_t head = LOAD_OWN(cbfifo->head);
+    size_t space = CBFIFO_CAPACITY - (head - LOAD_OTHER(cbfifo->tail));
+    size_t offset = head & CBFIFO_MASK;
+
+    *span = &cbfifo->buffer[offset];
+
+    //Stop at the end of the buffer; the rest is the next span
+    if (space > CBFIFO_CAPACITY - offset)
+        space = CBFIFO_CAPACITY - offset;
+    return space;
+}
+
+void cbfifo_commit_write(CircularBuffer_t* cbfifo, size_t nbyte)
+{
+    //Publish the bytes only once they are in the buffer
+    PUBLISH(cbfifo->head, LOAD_OWN(cbfifo->head) + nbyte);
 }
 
 size_t cbfifo_length (CircularBuffer_t* cbfifo)
 {
-    if ( cbfifo->size )           
-        return cbfifo->size;
-    else
-        return ZERO;
+    //Either side may ask. With the tail read first the length can only be overstated,
+    //by bytes dequeued in between, and never beyond the capacity
+    uint32_t tail = LOAD_OTHER(cbfifo->tail);
+    size_t length = LOAD_OTHER(cbfifo->head) - tail;
+    return (length > CBFIFO_CAPACITY) ? CBFIFO_CAPACITY : length;
 }
 
 size_t cbfifo_capacity (CircularBuffer_t* cbfifo)
 {
-    if (MAX_BUFFER_SIZE)
-        return MAX_BUFFER_SIZE;
-    else
-        return ZERO;
+    return CBFIFO_CAPACITY;
 }
 
 void   cbfifo_reset (CircularBuffer_t* cbfifo)
@@ -130,25 +156,21 @@ void   cbfifo_reset (CircularBuffer_t* cbfifo)
     //If invalid buffer
     if (!cbfifo)
         return;
-    memset(cbfifo->buffer, 0, sizeof(cbfifo->buffer));      //Reset all buffer values to 0
-    cbfifo->size=0;                                         //Reset the size to zero
-    cbfifo->front = 0;                                      //Reset the read pointer to 0
-    cbfifo->rear = 0;                                       //Reset the write pointer to 0
+    cbfifo->head = 0;                                       //Reset the write index
+    cbfifo->tail = 0;                                       //Reset the read index
     return;
 }
 
 #ifdef DEBUG
 void cbfifo_print (CircularBuffer_t* cbfifo)
 {
-    size_t rear=0;
     printf("\nPrinting CBFIFO\n\n");
-    for (size_t i=0; i<MAX_BUFFER_SIZE; i++)
+    for (uint32_t i = cbfifo->tail; i != cbfifo->head; i++)
     {
-        printf("%lld -> || %d ||           ", i, cbfifo->buffer[rear]);
-        rear++;
+        printf("%lu -> || %d ||           ", (unsigned long)(i & CBFIFO_MASK), cbfifo->buffer[i & CBFIFO_MASK]);
     }
-    printf("\nFRONT INDEX %d\n",cbfifo->front);
-    printf("\nREAR INDEX %d\n",cbfifo->rear);
+    printf("\nHEAD INDEX %lu\n", (unsigned long)cbfifo->head);
+    printf("\nTAIL INDEX %lu\n", (unsigned long)cbfifo->tail);
     printf("\nPrinting Completed\n\n");
     return;
 }
@@ -25,19 +25,35 @@
 #include <stdlib.h>  // for size_t
 #include <stdint.h>
 
-#define MAX_BUFFER_SIZE (255)
+#define CBFIFO_CAPACITY (256)                    // Bytes per FIFO, must be a power of two
+#define CBFIFO_MASK (CBFIFO_CAPACITY - 1)
+#define MAX_BUFFER_SIZE (CBFIFO_CAPACITY)
 
-/*Structure for circular buffer
+#if (CBFIFO_CAPACITY & CBFIFO_MASK) != 0
+#error "CBFIFO_CAPACITY must be a power of two"
+#endif
+
+/*Structure for circular buffer, one producer and one consumer
 *   buffer is the circular buffer where bytes will be enqueued and dequeued
-*   size is the number of bytes of data currently in the CBFIFO
-*   front is the position of the read pointer
-*   rear is the position of the write pointer
+*   head counts every byte ever enqueued, only the producer writes it
+*   tail counts every byte ever dequeued, only the consumer writes it
+*   Both run freely and wrap at 2^32; head - tail is the length and index & CBFIFO_MASK the slot
+*
+* Concurrency contract
+*   The producer calls only cbfifo_enqueue, cbfifo_write_span and cbfifo_commit_write.
+*   The consumer calls only cbfifo_dequeue, cbfifo_read_span and cbfifo_commit_read.
+*   Either side may call cbfifo_length and cbfifo_capacity at any time.
+*   Neither side needs to mask interrupts against the other. Two producers or two consumers
+*   must serialise themselves, and cbfifo_reset needs both sides stopped.
+*
+*   txfifo: producer __sys_write/write_UART (thread mode, or an interrupt that prints, so it masks
+*           interrupts against itself), consumer the UART0 transmit DMA or UART0_IRQHandler
+*   rxfifo: producer UART0_IRQHandler, consumer the terminal in thread mode
 */
 typedef struct CircularBuffer_s{
-    int buffer[MAX_BUFFER_SIZE];
-    uint8_t size;
-    uint8_t front;
-    uint8_t rear;
+    uint8_t buffer[CBFIFO_CAPACITY];
+    uint32_t head;
+    uint32_t tail;
 } CircularBuffer_t;
 
 extern CircularBuffer_t* txfifo;
@@ -84,6 +100,56 @@ size_t cbfifo_enqueue(void *buf, size_t nbyte, CircularBuffer_t* cbfifo);
 size_t cbfifo_dequeue(void *buf, size_t nbyte, CircularBuffer_t* cbfifo);
 
 
+/*
+ * Gives the consumer the oldest queued bytes in place, up to the end of the buffer.
+ * Nothing is removed until cbfifo_commit_read().
+ *
+ * Parameters:
+ *   span     Set to the first readable byte
+ *
+ * Returns:
+ *   Number of contiguous readable bytes at *span, which could be 0
+ */
+size_t cbfifo_read_span(CircularBuffer_t* cbfifo, uint8_t **span);
+
+
+/*
+ * Removes bytes the consumer has finished with.
+ *
+ * Parameters:
+ *   nbyte    Bytes to remove, at most the length of the last read span
+ *
+ * Returns:
+ *   Nothing
+ */
+void cbfifo_commit_read(CircularBuffer_t* cbfifo, size_t nbyte);
+
+
+/*
+ * Gives the producer the free space in place, up to the end of the buffer.
+ * Nothing is queued until cbfifo_commit_write().
+ *
+ * Parameters:
+ *   span     Set to the first writable byte
+ *
+ * Returns:
+ *   Number of contiguous writable bytes at *span, which could be 0
+ */
+size_t cbfifo_write_span(CircularBuffer_t* cbfifo, uint8_t **span);
+
+
+/*
+ * Queues bytes the producer has written into the last write span.
+ *
+ * Parameters:
+ *   nbyte    Bytes to queue, at most the length of the last write span
+ *
+ * Returns:
+ *   Nothing
+ */
+void cbfifo_commit_write(CircularBuffer_t* cbfifo, size_t nbyte);
+
+
 /*
  * Returns the number of bytes currently on the FIFO. 
  *
@@ -27,8 +27,10 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdlib.h>
 #include <ctype.h>
 #include <I2C.h>
+#include "I2C_trace.h"
 #include "UART.h"
 #include "cbfifo.h"
 #include "processor.h"
@@ -36,8 +38,10 @@
 #include "LCD.h"
 #include "DHT11.h"
 #include "RTC.h"
+#include "telemetry.h"
 
 #define MAX_TOKEN_SIZE (30)
+#define ECHO_MAX_STATIC_LENGTH (73)		// Characters that fit on the LCD before the clock
 
 // Fucntion pointer for command handlers
 typedef void (*command_handler_t)(int, char *argv[]);
@@ -51,14 +55,20 @@ const char *help_string;
 
 // Table of commands
 static const command_table_t commands[] = {
-		{"ECHO", echo_handler, "Echoes the same string back in upper case but removes any whitespaces."},
+		{"ECHO", echo_handler, "Echoes the same string back in upper case but removes any whitespaces. Long strings scroll, ECHO -M scrolls over the whole display."},
 		{"HUMIDITY", humidity_handler, "Displays the humidity."},
 		{"TEMP", temp_handler, "Displays the temperature."},
 		{"RESET", reset_handler, "Resets the clock."},
+		{"BENCH", bench_handler, "Compares CPU cycles of a full LCD refresh over polled and DMA I2C."},
+		{"I2CSTAT", i2cstat_handler, "Prints the I2C bus error counters. I2CSTAT CLEAR resets them."},
+		{"I2CSPEED", i2cspeed_handler, "I2CSPEED STD|FAST|MAX sets the LCD bus speed, I2CSPEED TEST finds the fastest reliable one."},
+		{"I2CTRACE", i2ctrace_handler, "I2C latency summary per device. I2CTRACE DUMP|ON|OFF|CLEAR."},
+		{"BAUD", baud_handler, "BAUD <rate> [8N1|8O2|...] changes the line settings, BAUD OK keeps them. Unconfirmed changes revert after 5 s."},
+		{"TELEMETRY", telemetry_handler, "TELEMETRY BIN [period ms] switches to COBS framed binary output and streams samples, TELEMETRY TEXT switches back."},
 		{"HELP", help_handler, "Details of the functions"}
 };
 
-static const int num_commands = 5;
+static const int num_commands = 11;
 
 /*
  * Handler function for the RESET command
@@ -85,6 +95,45 @@ void reset_handler(int argc, char *argv[])
  */
 void echo_handler(int argc, char *argv[])
 {
+	char message[LCD_MARQUEE_MAX_LENGTH];
+	int length = 0;
+	int first = 1;
+	bool exclusive = false;
+
+	stop_marquee_lcd();
+
+	// "-M" scrolls the message over the whole display
+	if ((argc > 1) && (strcmp(argv[1], "-M") == 0 || strcmp(argv[1], "-m") == 0))
+	{
+		exclusive = true;
+		first = 2;
+	}
+
+	// Join the tokens in upper case
+	for (int k = first; k < argc; k++)
+	{
+		for (int i = 0; (argv[k][i] != '\0') && (length < LCD_MARQUEE_MAX_LENGTH - 1); i++)
+		{
+			message[length++] = toupper(argv[k][i]);				// Change to upper case
+		}
+		if (length < LCD_MARQUEE_MAX_LENGTH - 1)
+			message[length++] = ' ';
+	}
+	message[length] = '\0';
+
+	// Messages that do not fit beside the clock scroll on row 0
+	if (exclusive || (length > ECHO_MAX_STATIC_LENGTH))
+	{
+		if (!exclusive)
+		{
+			send_command_lcd(LCD_CLEAR_DISPLAY);
+			while(read_byte_I2C(0x4E) & 0x80);	// busy wait
+			num_chars = 0;
+		}
+		start_marquee_lcd(0, message, LCD_MARQUEE_PERIOD_MS, exclusive);
+		return;
+	}
+
 	// Clear the display
 	send_command_lcd(LCD_CLEAR_DISPLAY);
 	while(read_byte_I2C(0x4E) & 0x80);	// busy wait
@@ -94,15 +143,10 @@ void echo_handler(int argc, char *argv[])
 	send_command_lcd(LCD_ROW_0);
 	while(read_byte_I2C(0x4E) & 0x80);	// busy wait
 
-	// If there are more than one tokens, print the rest
-	for (int k = 1; k < argc; k++)
+	// Print on LCD
+	for (int i = 0; i < length; i++)
 	{
-		for (int i = 0; i < strlen(argv[k]); i++)
-		{
-			*(argv[k] + i) = toupper(*(argv[k] + i));				// Change to upper case
-			put_char_lcd(*(argv[k] + i));							// Print on LCD
-		}
-		put_char_lcd(' ');
+		put_char_lcd(message[i]);
 	}
 }
 
@@ -116,6 +160,8 @@ void echo_handler(int argc, char *argv[])
  */
 void humidity_handler(int argc, char *argv[])
 {
+	stop_marquee_lcd();
+
 	// Get the data from the DHT11 sensor
 	send_start_DHT11();
 	get_data_DHT11();
@@ -147,6 +193,8 @@ void humidity_handler(int argc, char *argv[])
  */
 void temp_handler(int argc, char *argv[])
 {
+	stop_marquee_lcd();
+
 	// Get the data from the DHT11 sensor
 	send_start_DHT11();
 	get_data_DHT11();
@@ -167,6 +215,255 @@ void temp_handler(int argc, char *argv[])
 	put_char_lcd('C');
 }
 
+/*
+ * Handler function for the BENCH command
+ *
+ * Parameters: The token pointers and number of tokens
+ *
+ * Returns: none
+ *
+ */
+void bench_handler(int argc, char *argv[])
+{
+	uint32_t polled_cycles, dma_cycles;
+
+	stop_marquee_lcd();
+	benchmark_refresh_lcd(&polled_cycles, &dma_cycles);
+	printf("\n\rLCD refresh (80 characters): polled %lu cycles, DMA %lu cycles",
+			(unsigned long)polled_cycles, (unsigned long)dma_cycles);
+}
+
+/*
+ * Handler function for the I2CSTAT command
+ *
+ * Parameters: The token pointers and number of tokens
+ *
+ * Returns: none
+ *
+ */
+void i2cstat_handler(int argc, char *argv[])
+{
+	const i2c_stats_t *stats = stats_I2C();
+
+	printf("\n\rI2C timeouts: %lu, arbitration lost: %lu, NACKs: %lu, recoveries: %lu",
+			(unsigned long)stats->timeouts, (unsigned long)stats->arbitration_lost,
+			(unsigned long)stats->nacks, (unsigned long)stats->recoveries);
+
+	if ((argc > 1) && (strcasecmp(argv[1], "CLEAR") == 0))
+	{
+		reset_stats_I2C();
+		printf("\n\rCounters cleared");
+	}
+}
+
+/*
+ * Handler function for the I2CSPEED command
+ *
+ * Parameters: The token pointers and number of tokens
+ *
+ * Returns: none
+ *
+ */
+void i2cspeed_handler(int argc, char *argv[])
+{
+	if (argc > 1)
+	{
+		if (strcasecmp(argv[1], "STD") == 0)
+		{
+			set_profile_I2C(&lcd_device, I2C_SPEED_STANDARD);
+		}
+		else if (strcasecmp(argv[1], "FAST") == 0)
+		{
+			set_profile_I2C(&lcd_device, I2C_SPEED_FAST);
+		}
+		else if (strcasecmp(argv[1], "MAX") == 0)
+		{
+			set_profile_I2C(&lcd_device, I2C_SPEED_MAX_RELIABLE);
+		}
+		else if (strcasecmp(argv[1], "TEST") == 0)
+		{
+			i2c_speed_result_t results[I2C_SPEED_TEST_STEPS];
+			uint32_t fastest_hz = speed_test_lcd(results);
+
+			for (int i = 0; i < I2C_SPEED_TEST_STEPS; i++)
+			{
+				printf("\n\r%7lu Hz (actual %7lu Hz): %u errors", (unsigned long)results[i].requested_hz,
+						(unsigned long)results[i].actual_hz, results[i].errors);
+			}
+			if (fastest_hz == 0)
+				printf("\n\rNo speed passed, check the wiring");
+			else
+				printf("\n\rFastest reliable speed: %lu Hz (I2CSPEED MAX to use it)", (unsigned long)fastest_hz);
+			return;
+		}
+		else
+		{
+			printf("\n\rUsage: I2CSPEED [STD|FAST|MAX|TEST]");
+			return;
+		}
+	}
+	printf("\n\rLCD bus speed: %lu Hz", (unsigned long)lcd_device.speed_hz);
+}
+
+/*
+ * Handler function for the I2CTRACE command
+ *
+ * Parameters: The token pointers and number of tokens
+ *
+ * Returns: none
+ *
+ */
+void i2ctrace_handler(int argc, char *argv[])
+{
+	static const char status_code[] = "-PIKNATQ";		// Indexed by i2c_status_t, K = done
+	i2c_trace_device_t device;
+	i2c_trace_entry_t entry;
+
+	if (argc > 1)
+	{
+		if (strcasecmp(argv[1], "ON") == 0)
+		{
+			set_trace_I2C(true);
+		}
+		else if (strcasecmp(argv[1], "OFF") == 0)
+		{
+			set_trace_I2C(false);
+		}
+		else if (strcasecmp(argv[1], "CLEAR") == 0)
+		{
+			clear_trace_I2C();
+		}
+		else if (strcasecmp(argv[1], "DUMP") == 0)
+		{
+			// One line per transaction: direction, address, bytes, start and duration in us, status
+			uint32_t cycles_per_us = US_TO_CYCLES(1);
+			printf("\n\rD AD LEN    START_US  DUR_US S");
+			for (uint16_t i = 0; trace_entry_I2C(i, &entry); i++)
+			{
+				printf("\n\r%c %02X %3u %11lu %7lu %c", entry.direction, entry.address, entry.length,
+						(unsigned long)(entry.start / cycles_per_us), (unsigned long)((entry.end - entry.start) / cycles_per_us),
+						status_code[entry.status]);
+			}
+		}
+		else
+		{
+			printf("\n\rUsage: I2CTRACE [DUMP|ON|OFF|CLEAR]");
+		}
+		return;
+	}
+
+	printf("\n\rI2C trace %s, %lu entries overwritten", is_trace_on_I2C() ? "on" : "off",
+			(unsigned long)trace_overwritten_I2C());
+	for (uint8_t i = 0; trace_device_I2C(i, &device); i++)
+	{
+		printf("\n\r0x%02X: %lu transactions, %lu bytes, %lu errors, mean %lu us, max %lu us\n\r     ",
+				device.address, (unsigned long)device.transactions, (unsigned long)device.bytes,
+				(unsigned long)device.errors, (unsigned long)(device.total_us / device.transactions),
+				(unsigned long)device.max_us);
+		// Non-empty latency buckets as <lower bound in us>:<count>
+		for (uint8_t bucket = 0; bucket < I2C_LATENCY_BUCKETS; bucket++)
+		{
+			if (device.histogram[bucket] != 0)
+				printf(" %lu:%lu", (unsigned long)(bucket ? (1UL << bucket) : 0), (unsigned long)device.histogram[bucket]);
+		}
+	}
+}
+
+/*
+ * Handler function for the BAUD command
+ *
+ * Parameters: The token pointers and number of tokens
+ *
+ * Returns: none
+ *
+ */
+void baud_handler(int argc, char *argv[])
+{
+	static const char parity_code[] = "NEO";		// Indexed by uart_parity_t
+	const uart_config_t *current = config_UART();
+
+	if ((argc > 1) && (strcasecmp(argv[1], "OK") == 0))
+	{
+		confirm_UART();
+		printf("\n\rLine settings kept");
+		return;
+	}
+
+	if (argc > 1)
+	{
+		// New rates default to 8N1
+		uart_config_t config = {0, 8, UART_PARITY_NONE, 1};
+		char *end;
+
+		config.baud_rate = strtoul(argv[1], &end, 10);
+		bool valid = (*end == '\0') && (config.baud_rate != 0);
+		if (valid && (argc > 2))
+		{
+			// Format as <data bits><parity><stop bits>, for example 8N1
+			const char *format = argv[2];
+			const char *parity = strchr(parity_code, toupper(format[1]));
+			valid = (strlen(format) == 3) && (parity != NULL) &&
+					(format[0] == '7' || format[0] == '8') && (format[2] == '1' || format[2] == '2');
+			if (valid)
+			{
+				config.data_bits = format[0] - '0';
+				config.parity = (uart_parity_t)(parity - parity_code);
+				config.stop_bits = format[2] - '0';
+			}
+		}
+		if (!valid)
+		{
+			printf("\n\rUsage: BAUD [<rate> [8N1|8E1|8O1|8O2|...]|OK]");
+			return;
+		}
+
+		printf("\n\rSwitching to %lu %u%c%u, type BAUD OK within %u s to keep it", (unsigned long)config.baud_rate,
+				config.data_bits, parity_code[config.parity], config.stop_bits, UART_CONFIRM_TIMEOUT_MS / 1000);
+		if (!configure_UART(&config))
+			printf("\n\r%lu %u%c%u cannot be set", (unsigned long)config.baud_rate,
+					config.data_bits, parity_code[config.parity], config.stop_bits);
+		return;
+	}
+
+	printf("\n\rUART0: %lu %u%c%u (actual %lu baud)", (unsigned long)current->baud_rate, current->data_bits,
+			parity_code[current->parity], current->stop_bits, (unsigned long)actual_baud_UART());
+}
+
+/*
+ * Handler function for the TELEMETRY command
+ *
+ * Parameters: The token pointers and number of tokens
+ *
+ * Returns: none
+ *
+ */
+void telemetry_handler(int argc, char *argv[])
+{
+	if ((argc > 1) && (strcasecmp(argv[1], "TEXT") == 0))
+	{
+		set_mode_telemetry(TELEMETRY_TEXT);
+	}
+	else if ((argc > 1) && (strcasecmp(argv[1], "BIN") == 0))
+	{
+		uint32_t period_ms = (argc > 2) ? strtoul(argv[2], NULL, 10) : 0;
+
+		printf("\n\rSwitching to binary frames, TELEMETRY TEXT switches back");
+		set_mode_telemetry(TELEMETRY_BINARY);
+		if (period_ms != 0)
+			start_stream_telemetry(period_ms);
+		else
+			send_sample_telemetry();
+		return;
+	}
+	else if (argc > 1)
+	{
+		printf("\n\rUsage: TELEMETRY [TEXT|BIN [period ms]]");
+		return;
+	}
+
+	printf("\n\rOutput mode: %s", (mode_telemetry() == TELEMETRY_BINARY) ? "binary" : "text");
+}
+
 /*
  * Handler function for the HELP command
  *
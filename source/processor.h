@@ -129,5 +129,65 @@ void humidity_handler(int argc, char *argv[]);
  */
 void reset_handler(int argc, char *argv[]);
 
+/*
+ * Handler function for the BENCH command
+ *
+ * Parameters: The token pointers and number of tokens
+ *
+ * Returns: none
+ *
+ */
+void bench_handler(int argc, char *argv[]);
+
+/*
+ * Handler function for the I2CSTAT command
+ *
+ * Parameters: The token pointers and number of tokens
+ *
+ * Returns: none
+ *
+ */
+void i2cstat_handler(int argc, char *argv[]);
+
+/*
+ * Handler function for the I2CSPEED command
+ *
+ * Parameters: The token pointers and number of tokens
+ *
+ * Returns: none
+ *
+ */
+void i2cspeed_handler(int argc, char *argv[]);
+
+/*
+ * Handler function for the I2CTRACE command
+ *
+ * Parameters: The token pointers and number of tokens
+ *
+ * Returns: none
+ *
+ */
+void i2ctrace_handler(int argc, char *argv[]);
+
+/*
+ * Handler function for the BAUD command
+ *
+ * Parameters: The token pointers and number of tokens
+ *
+ * Returns: none
+ *
+ */
+void baud_handler(int argc, char *argv[]);
+
+/*
+ * Handler function for the TELEMETRY command
+ *
+ * Parameters: The token pointers and number of tokens
+ *
+ * Returns: none
+ *
+ */
+void telemetry_handler(int argc, char *argv[]);
+
 
 #endif /* PROCESSOR_H_ */
@@ -0,0 +1,250 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Trapti Damodar Balgi
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Trapti Damodar Balgi and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+* @file telemetry.c
+* @brief
+*
+* Binary telemetry frames on UART0
+*
+* @author Trapti Damodar Balgi
+* @date 13th December 2023
+* @version 1.0
+*/
+
+#include <MKL25Z4.H>
+#include "telemetry.h"
+#include "UART.h"
+#include "timers.h"
+#include "DHT11.h"
+
+#define FRAME_LENGTH (TELEMETRY_HEADER_LENGTH + TELEMETRY_MAX_PAYLOAD + TELEMETRY_CRC_LENGTH)
+#define ENCODED_LENGTH (FRAME_LENGTH + (FRAME_LENGTH / 254) + 2)		// COBS overhead and the delimiter
+#define COBS_MAX_RUN (0xFF)
+#define CRC16_INITIAL (0xFFFF)
+#define FRAME_DELIMITER (0x00)
+
+// CRC16-CCITT of every nibble value, so the CRC costs two lookups per byte
+static const uint16_t crc_table[16] = {
+		0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+		0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+static volatile telemetry_mode_t mode = TELEMETRY_TEXT;
+static uint16_t sequence = 0;
+static bool streaming = false;
+static ticktime_t stream_period = 0;
+static ticktime_t last_sample = 0;
+
+/*
+ * Computes the CRC16-CCITT of a buffer
+ *
+ * Parameters:
+ * 	data	Bytes to check
+ * 	length	Number of bytes
+ *
+ * Returns: the CRC
+ *
+ */
+uint16_t crc16_telemetry(const uint8_t *data, size_t length)
+{
+	uint16_t crc = CRC16_INITIAL;
+
+	for (size_t i = 0; i < length; i++)
+	{
+		crc = (crc << 4) ^ crc_table[(crc >> 12) ^ (data[i] >> 4)];
+		crc = (crc << 4) ^ crc_table[(crc >> 12) ^ (data[i] & 0x0F)];
+	}
+	return crc;
+}
+
+/*
+ * COBS encodes a buffer so that it contains no zero bytes
+ *
+ * Parameters:
+ * 	in		Bytes to encode
+ * 	length	Number of bytes in in
+ * 	out		Destination, at least length + length / 254 + 1 bytes
+ *
+ * Returns: number of bytes written to out, not including a delimiter
+ *
+ */
+size_t cobs_encode_telemetry(const uint8_t *in, size_t length, uint8_t *out)
+{
+	size_t code_index = 0;		// Where the length of the current run goes
+	size_t out_index = 1;
+	uint8_t code = 1;
+
+	for (size_t i = 0; i < length; i++)
+	{
+		if (in[i] == 0)
+		{
+			out[code_index] = code;
+			code_index = out_index++;
+			code = 1;
+		}
+		else
+		{
+			out[out_index++] = in[i];
+			code++;
+			// A full run of 254 non-zero bytes ends without an implied zero
+			if (code == COBS_MAX_RUN)
+			{
+				out[code_index] = code;
+				code_index = out_index++;
+				code = 1;
+			}
+		}
+	}
+	out[code_index] = code;
+
+	return out_index;
+}
+
+/*
+ * Switches UART0 between text and binary output
+ *
+ * Parameters: mode
+ *
+ * Returns: none
+ *
+ */
+void set_mode_telemetry(telemetry_mode_t new_mode)
+{
+	mode = new_mode;
+	if (new_mode == TELEMETRY_TEXT)
+		streaming = false;
+}
+
+/*
+ * Returns the UART0 output mode
+ *
+ * Parameters: none
+ *
+ * Returns: TELEMETRY_TEXT or TELEMETRY_BINARY
+ *
+ */
+telemetry_mode_t mode_telemetry(void)
+{
+	return mode;
+}
+
+/*
+ * Builds, encodes and queues one frame
+ *
+ * Parameters:
+ * 	type	Frame type
+ * 	payload	Payload bytes
+ * 	length	Payload length, up to TELEMETRY_MAX_PAYLOAD
+ *
+ * Returns: true if the whole frame was queued
+ *
+ */
+bool send_frame_telemetry(telemetry_frame_t type, const uint8_t *payload, size_t length)
+{
+	uint8_t frame[FRAME_LENGTH];
+	uint8_t encoded[ENCODED_LENGTH];
+
+	if (length > TELEMETRY_MAX_PAYLOAD)
+		return false;
+
+	uint32_t timestamp = RTC->TSR;
+	frame[0] = (uint8_t)type;
+	frame[1] = (uint8_t)sequence;
+	frame[2] = (uint8_t)(sequence >> 8);
+	frame[3] = (uint8_t)timestamp;
+	frame[4] = (uint8_t)(timestamp >> 8);
+	frame[5] = (uint8_t)(timestamp >> 16);
+	frame[6] = (uint8_t)(timestamp >> 24);
+	for (size_t i = 0; i < length; i++)
+	{
+		frame[TELEMETRY_HEADER_LENGTH + i] = payload[i];
+	}
+	length += TELEMETRY_HEADER_LENGTH;
+
+	uint16_t crc = crc16_telemetry(frame, length);
+	frame[length++] = (uint8_t)crc;
+	frame[length++] = (uint8_t)(crc >> 8);
+
+	size_t encoded_length = cobs_encode_telemetry(frame, length, encoded);
+	encoded[encoded_length++] = FRAME_DELIMITER;
+
+	// The sequence number advances even for frames that are lost, so the host can count them
+	sequence++;
+	return write_UART(encoded, encoded_length) == 0;
+}
+
+/*
+ * Reads the DHT11 and sends the reading as a sample frame
+ *
+ * Parameters: none
+ *
+ * Returns: true if the frame was queued
+ *
+ */
+bool send_sample_telemetry(void)
+{
+	send_start_DHT11();
+	get_data_DHT11();
+
+	uint8_t reading[] = {hum_i_buffer, hum_d_buffer, temp_i_buffer, temp_d_buffer};
+	return send_frame_telemetry(TELEMETRY_FRAME_SAMPLE, reading, sizeof(reading));
+}
+
+/*
+ * Starts sending a sample frame every period_ms
+ *
+ * Parameters: period_ms, raised to TELEMETRY_MIN_PERIOD_MS if shorter
+ *
+ * Returns: none
+ *
+ */
+void start_stream_telemetry(uint32_t period_ms)
+{
+	if (period_ms < TELEMETRY_MIN_PERIOD_MS)
+		period_ms = TELEMETRY_MIN_PERIOD_MS;
+
+	stream_period = MS_TO_TICKS(period_ms);
+	last_sample = now() - stream_period;			// First sample on the next call of task_telemetry()
+	streaming = true;
+}
+
+/*
+ * Stops the sample stream
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void stop_stream_telemetry(void)
+{
+	streaming = false;
+}
+
+/*
+ * Sends a sample when the stream period has elapsed. Call from the idle loop.
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void task_telemetry(void)
+{
+	if (!streaming || (mode != TELEMETRY_BINARY) || ((now() - last_sample) < stream_period))
+		return;
+
+	last_sample += stream_period;
+	// Do not try to catch up after a long command
+	if ((now() - last_sample) >= stream_period)
+		last_sample = now();
+	send_sample_telemetry();
+}
@@ -0,0 +1,149 @@
+/*******************************************************************************
+ * Copyright (C) 2023 by Trapti Damodar Balgi
+ *
+ * Redistribution, modification or use of this software in source or binary
+ * forms is permitted as long as the files maintain this copyright. Users are
+ * permitted to modify this and use it to learn about the field of embedded
+ * software. Trapti Damodar Balgi and the University of Colorado are not liable for
+ * any misuse of this material.
+ * ****************************************************************************/
+
+/**
+* @file telemetry.h
+* @brief
+*
+* Binary telemetry frames on UART0
+*
+* A frame is COBS encoded and ends with a 0x00 delimiter. Decoded, it holds
+*   type (1 byte), sequence number (2 bytes), RTC seconds (4 bytes), payload, CRC16 (2 bytes)
+* Multi-byte fields are little endian. The CRC16 is CCITT (polynomial 0x1021, initial 0xFFFF)
+* over everything before it.
+*
+* @author Trapti Damodar Balgi
+* @date 13th December 2023
+* @version 1.0
+*/
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TELEMETRY_MAX_PAYLOAD (64)
+#define TELEMETRY_HEADER_LENGTH (7)
+#define TELEMETRY_CRC_LENGTH (2)
+#define TELEMETRY_MIN_PERIOD_MS (1000)		// The DHT11 cannot be read more often than this
+
+// Output mode of UART0
+typedef enum {
+	TELEMETRY_TEXT,				// printf output as is
+	TELEMETRY_BINARY			// printf output carried in TELEMETRY_FRAME_TEXT frames
+} telemetry_mode_t;
+
+// Frame types
+typedef enum {
+	TELEMETRY_FRAME_SAMPLE = 1,		// Payload: humidity integer, humidity decimal, temperature integer, temperature decimal
+	TELEMETRY_FRAME_TEXT = 2		// Payload: text written while in binary mode
+} telemetry_frame_t;
+
+/*
+ * Computes the CRC16-CCITT of a buffer
+ *
+ * Parameters:
+ * 	data	Bytes to check
+ * 	length	Number of bytes
+ *
+ * Returns: the CRC
+ *
+ */
+uint16_t crc16_telemetry(const uint8_t *data, size_t length);
+
+/*
+ * COBS encodes a buffer so that it contains no zero bytes
+ *
+ * Parameters:
+ * 	in		Bytes to encode
+ * 	length	Number of bytes in in
+ * 	out		Destination, at least length + length / 254 + 1 bytes
+ *
+ * Returns: number of bytes written to out, not including a delimiter
+ *
+ */
+size_t cobs_encode_telemetry(const uint8_t *in, size_t length, uint8_t *out);
+
+/*
+ * Switches UART0 between text and binary output
+ *
+ * Parameters: mode
+ *
+ * Returns: none
+ *
+ */
+void set_mode_telemetry(telemetry_mode_t mode);
+
+/*
+ * Returns the UART0 output mode
+ *
+ * Parameters: none
+ *
+ * Returns: TELEMETRY_TEXT or TELEMETRY_BINARY
+ *
+ */
+telemetry_mode_t mode_telemetry(void);
+
+/*
+ * Builds, encodes and queues one frame
+ *
+ * Parameters:
+ * 	type	Frame type
+ * 	payload	Payload bytes
+ * 	length	Payload length, up to TELEMETRY_MAX_PAYLOAD
+ *
+ * Returns: true if the whole frame was queued
+ *
+ */
+bool send_frame_telemetry(telemetry_frame_t type, const uint8_t *payload, size_t length);
+
+/*
+ * Reads the DHT11 and sends the reading as a sample frame
+ *
+ * Parameters: none
+ *
+ * Returns: true if the frame was queued
+ *
+ */
+bool send_sample_telemetry(void);
+
+/*
+ * Starts sending a sample frame every period_ms
+ *
+ * Parameters: period_ms, raised to TELEMETRY_MIN_PERIOD_MS if shorter
+ *
+ * Returns: none
+ *
+ */
+void start_stream_telemetry(uint32_t period_ms);
+
+/*
+ * Stops the sample stream
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void stop_stream_telemetry(void);
+
+/*
+ * Sends a sample when the stream period has elapsed. Call from the idle loop.
+ *
+ * Parameters: none
+ *
+ * Returns: none
+ *
+ */
+void task_telemetry(void);
+
+#endif /* TELEMETRY_H_ */
@@ -62,6 +62,33 @@ ticktime_t now(void)
 	return time_since_startup;
 }
 
+/*
+ * The function returns the core clock cycles since startup, to a resolution of
+ * SYSTICK_CYCLES_PER_COUNT. Wraps after about 89 seconds, so use it for differences
+ *
+ * Parameters: none
+ *
+ * Returns: Core clock cycles as a 32 bit value
+ *
+ */
+uint32_t cycle_count(void)
+{
+	uint32_t primask = __get_PRIMASK();
+	__disable_irq();
+
+	uint32_t ticks = time_since_startup;
+	uint32_t count = SysTick -> VAL;
+	// The counter wrapped but the handler has not run yet
+	if (SCB -> ICSR & SCB_ICSR_PENDSTSET_Msk)
+	{
+		ticks++;
+		count = SysTick -> VAL;
+	}
+
+	__set_PRIMASK(primask);
+	return ((ticks * (SYSTICK_FOURTEEN_US + 1)) + (SYSTICK_FOURTEEN_US - count)) * SYSTICK_CYCLES_PER_COUNT;
+}
+
 /*
  * The function resets the time_since_reset counter & reload value
  *
@@ -36,6 +36,11 @@
 typedef uint32_t ticktime_t;  // time since boot, in sixteenths of a second
 
 #define SYSTICK_FOURTEEN_US (42)	// Systick load value to get an interrupt every 14us (3MHz*14us)
+#define SYSTICK_US_PER_TICK (14)	// Resolution of now() and get_timer()
+#define SYSTICK_CYCLES_PER_COUNT (16)	// SysTick counts the core clock divided by 16
+
+#define US_TO_CYCLES(us) ((uint32_t)(us) * (SystemCoreClock / 1000000U))
+#define MS_TO_TICKS(ms) ((ticktime_t)(((ms) * 1000UL) / SYSTICK_US_PER_TICK))
 
 /*
  * This function initializes the SysTick
@@ -57,6 +62,17 @@ void init_systick(void);
  */
 ticktime_t now(void);
 
+/*
+ * The function returns the core clock cycles since startup, to a resolution of
+ * SYSTICK_CYCLES_PER_COUNT. Wraps after about 89 seconds, so use it for differences
+ *
+ * Parameters: none
+ *
+ * Returns: Core clock cycles as a 32 bit value
+ *
+ */
+uint32_t cycle_count(void);
+
 /*
  * The function resets the time_since_reset counter & reload value
  *